@@ -0,0 +1,16 @@
+# Turning file list of torrent into Structs by decoding to Hashes and
+# copying them over compared to building Structs directly with as:.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+TorrentFile = Struct.new(:length, :path)
+files = (0...100_000).map { |i| {'length' => i * 1024, 'path' => ['dir', "file#{i}.bin"], 'md5sum' => 'x' * 32} }
+torrent = {'info' => {'files' => files, 'name' => 'big', 'pieces' => 'x' * 20 * 1000}}.bencode
+
+Benchmark.bm(5) do |x|
+  x.report('copy') do
+    5.times { torrent.bdecode['info']['files'].map { |f| TorrentFile.new(f['length'], f['path']) } }
+  end
+  x.report('as') { 5.times { torrent.bdecode(as: {'info.files' => TorrentFile})['info']['files'] } }
+end
@@ -0,0 +1,18 @@
+# Decoding of deeply nested and container heavy structures,
+# stresses bookkeeping done on every list/dictionary boundary.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+deep = 'l' * 4000 + 'e' * 4000
+nested = "l#{'ld1:ali1eeee' * 100_000}e"
+dicts = (0...100_000).map { |i| {'a' => [], 'b' => {}} }.bencode
+
+depth = BEncode.max_depth
+BEncode.max_depth = nil
+Benchmark.bm(10) do |x|
+  x.report('deep') { 500.times { deep.bdecode } }
+  x.report('nested') { 10.times { nested.bdecode } }
+  x.report('dicts') { 10.times { dicts.bdecode } }
+end
+BEncode.max_depth = depth
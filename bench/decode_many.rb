@@ -0,0 +1,18 @@
+# Batch decoding of small torrent-like blobs one by one and with
+# BEncode.decode_many using different number of threads.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+blobs = (0...20_000).map do |i|
+  {'announce' => "http://tracker#{i % 10}/announce",
+   'info' => {'name' => "torrent#{i}", 'piece length' => 262_144, 'pieces' => 'x' * 2000,
+              'files' => (0...20).map { |j| {'length' => j * 1024, 'path' => ["f#{j}"]} }}}.bencode
+end
+
+Benchmark.bm(12) do |x|
+  x.report('decode') { blobs.map(&:bdecode) }
+  [1, 2, 4, 8].each do |n|
+    x.report("threads: #{n}") { BEncode.decode_many(blobs, threads: n) }
+  end
+end
@@ -0,0 +1,15 @@
+# BEP 9 data message (dict header followed by 16KB piece) split with
+# BEncode.decode_prefix compared to decoding a header that has been
+# cut out in advance, which is the lower bound.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+header = {'msg_type' => 1, 'piece' => 3, 'total_size' => 123_456}.bencode
+msg = header + 'x' * 16 * 1024
+
+Benchmark.bm(13) do |x|
+  x.report('header only') { 500_000.times { header.bdecode } }
+  x.report('decode_prefix') { 500_000.times { BEncode.decode_prefix(msg) } }
+  x.report('with payload') { 500_000.times { _, pos = BEncode.decode_prefix(msg); msg.byteslice(pos..-1) } }
+end
@@ -0,0 +1,23 @@
+# Decoding and encoding small DHT messages with module functions
+# and with reusable BEncode::Decoder and BEncode::Encoder.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+msgs = (0...1000).map do |i|
+  {'t' => [i].pack('n'), 'y' => 'r', 'r' => {'id' => 'i' * 20, 'token' => 't' * 8,
+   'nodes' => 'n' * 208, 'values' => ['v' * 6] * 4}}
+end
+encoded = msgs.map(&:bencode)
+decoder = BEncode::Decoder.new(symbolize_keys: true, max_depth: 8)
+encoder = BEncode::Encoder.new
+out = String.new(capacity: 1024)
+
+Benchmark.bm(20) do |x|
+  x.report('decode') { 100.times { encoded.each { |m| BEncode.decode(m) } } }
+  x.report('decode options') { 100.times { encoded.each { |m| BEncode.decode(m, symbolize_keys: true, max_depth: 8) } } }
+  x.report('Decoder#decode') { 100.times { encoded.each { |m| decoder.decode(m) } } }
+  x.report('bencode') { 100.times { msgs.each(&:bencode) } }
+  x.report('Encoder#encode') { 100.times { msgs.each { |m| encoder.encode(m) } } }
+  x.report('Encoder#encode out') { 100.times { msgs.each { |m| encoder.encode(m, out) } } }
+end
@@ -0,0 +1,22 @@
+# Walking a log of concatenated records with BEncode.each compared to
+# feeding the same data to BEncode::Parser, from a String and from IO.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'stringio'
+require 'bencode_ext'
+
+log = (0...200_000).map { |i| {'seq' => i, 'op' => 'put', 'key' => "k#{i}", 'tags' => ['a', 'b']}.bencode }.join
+
+Benchmark.bm(15) do |x|
+  x.report('parser string') { 5.times { n = 0; BEncode::Parser.new.feed(log) { n += 1 } } }
+  x.report('each string') { 5.times { n = 0; BEncode.each(log) { n += 1 } } }
+  x.report('parser io') do
+    5.times do
+      io, parser = StringIO.new(log), BEncode::Parser.new
+      while chunk = io.read(64 * 1024)
+        parser.feed(chunk) { }
+      end
+    end
+  end
+  x.report('each io') { 5.times { BEncode.each(StringIO.new(log)) { } } }
+end
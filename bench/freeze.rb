@@ -0,0 +1,25 @@
+# Getting Ractor shareable torrent metadata: decoding then freezing
+# in Ruby or with Ractor.make_shareable, and decoding with freeze: true.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+files = (0...20_000).map { |i| {'length' => i * 4096, 'path' => ['dir', "file#{i}.bin"]} }
+torrent = {'announce' => 'http://tracker.example.com/announce', 'info' => {'name' => 'big',
+           'piece length' => 262144, 'pieces' => 'x' * 200_000, 'files' => files}}.bencode
+
+deep_freeze = lambda do |v|
+  case v
+  when Hash then v.each_value(&deep_freeze)
+  when Array then v.each(&deep_freeze)
+  end
+  v.freeze
+end
+
+Benchmark.bm(20) do |x|
+  x.report('decode') { 20.times { torrent.bdecode } }
+  x.report('decode + freeze') { 20.times { deep_freeze[torrent.bdecode] } }
+  x.report('make_shareable') { 20.times { Ractor.make_shareable(torrent.bdecode) } }
+  x.report('freeze: true') { 20.times { torrent.bdecode(freeze: true) } }
+  x.report('+ make_shareable') { 20.times { Ractor.make_shareable(torrent.bdecode(freeze: true)) } }
+end
@@ -0,0 +1,17 @@
+# Opening a list of 1M scrape records and fetching one element with
+# BEncode.view_file, scanning the file each time and using saved index.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'tmpdir'
+require 'bencode_ext'
+
+Dir.mktmpdir do |dir|
+  path = File.join(dir, 'scrape.benc')
+  File.binwrite(path, (0...1_000_000).map { |i| {'complete' => i, 'downloaded' => i * 2, 'incomplete' => 7} }.bencode)
+
+  Benchmark.bm(6) do |x|
+    x.report('build') { BEncode.build_index(path) }
+    x.report('scan') { 10.times { BEncode.view_file(path)[654_321].decode } }
+    x.report('index') { 10.times { BEncode.view_file(path, index: true)[654_321].decode } }
+  end
+end
@@ -0,0 +1,32 @@
+# Worst latency of a thread ticking every millisecond while
+# another one decodes big input, with and without GVL release.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'bencode_ext'
+
+data = (0...200).map { |i| {'name' => "torrent#{i}", 'pieces' => 'x' * 200_000, 'files' => (0...500).map { |j| [j, "f#{j}"] }} }.bencode
+
+def worst_tick
+  worst, stop = 0, false
+  ticker = Thread.new do
+    until stop
+      t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      sleep 0.001
+      worst = [worst, Process.clock_gettime(Process::CLOCK_MONOTONIC) - t].max
+    end
+  end
+  sleep 0.01
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  yield
+  total = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+  stop = true
+  ticker.join
+  [total, worst]
+end
+
+threshold = BEncode.nogvl_threshold
+[['gvl', nil], ['nogvl', threshold]].each do |name, value|
+  BEncode.nogvl_threshold = value
+  total, worst = worst_tick { 5.times { data.bdecode } }
+  printf("%-8s total %.3fs, worst tick %.1fms\n", name, total, worst * 1000)
+end
+BEncode.nogvl_threshold = threshold
@@ -0,0 +1,15 @@
+# Decoding torrent with 20k files and 10MB of piece hashes completely
+# and with pieces and file paths filtered out by only:/except:.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+files = (0...20_000).map { |i| {'length' => i * 1024, 'path' => ['dir', 'sub', "file#{i}.bin"]} }
+torrent = {'announce' => 'http://tracker/', 'info' => {'files' => files, 'name' => 'big',
+           'piece length' => 262_144, 'pieces' => 'x' * 20 * 500_000}}.bencode
+
+Benchmark.bm(7) do |x|
+  x.report('full') { 20.times { BEncode.decode(torrent) } }
+  x.report('except') { 20.times { BEncode.decode(torrent, except: ['info.pieces', 'info.files.path']) } }
+  x.report('only') { 20.times { BEncode.decode(torrent, only: ['announce', 'info.name', ['info', 'piece length']]) } }
+end
@@ -0,0 +1,24 @@
+# Decoding of integer and length prefix heavy messages:
+# DHT (KRPC) queries and tracker announce responses.
+# The view rows only validate input, so they time number
+# parsing without Ruby object allocation.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+N = 200_000
+
+ping = {'t' => 'aa', 'y' => 'q', 'q' => 'ping', 'a' => {'id' => 'x' * 20}}.bencode
+ints = (0...64).map { |i| i * 1_234_567_891 }.bencode
+announce = {'interval' => 1800, 'min interval' => 900, 'complete' => 1234, 'incomplete' => 56,
+            'peers' => (0...50).map { |i| {'ip' => "10.0.0.#{i}", 'port' => 6881 + i} }}.bencode
+big_ints = (0...1_000_000).map { |i| i * 7_919 }.bencode
+big_strs = (0...1_000_000).map { |i| 'x' * (i % 16) }.bencode
+
+Benchmark.bm(14) do |x|
+  x.report('ping') { N.times { ping.bdecode } }
+  x.report('ints') { (N / 10).times { ints.bdecode } }
+  x.report('announce') { (N / 50).times { announce.bdecode } }
+  x.report('view ints') { 20.times { BEncode.view(big_ints) } }
+  x.report('view strings') { 20.times { BEncode.view(big_strs) } }
+end
@@ -0,0 +1,23 @@
+# Decoding torrent with 500k pieces and checking every digest, with
+# pieces as String sliced by scan(/.{20}/m) and as BEncode::PieceList.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+digests = (0...500_000).map { |i| [i].pack('N') * 5 }
+torrent = {'info' => {'name' => 'big', 'piece length' => 262_144, 'pieces' => digests.join}}.bencode
+
+Benchmark.bm(10) do |x|
+  x.report('string') do
+    5.times do
+      list = torrent.bdecode['info']['pieces'].scan(/.{20}/m)
+      digests.each_with_index { |d, i| list[i] == d }
+    end
+  end
+  x.report('piece_list') do
+    5.times do
+      list = torrent.bdecode(piece_list: true)['info']['pieces']
+      digests.each_with_index { |d, i| list.match?(i, d) }
+    end
+  end
+end
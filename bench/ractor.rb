@@ -0,0 +1,21 @@
+# Decoding the same torrent in one thread and split between Ractors.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'etc'
+require 'bencode_ext'
+
+Warning[:experimental] = false
+files = (0...5000).map { |i| {'length' => i * 4096, 'path' => ['dir', "file#{i}.bin"]} }
+torrent = Ractor.make_shareable({'announce' => 'http://tracker.example.com/announce',
+                                 'info' => {'name' => 'big', 'files' => files}}.bencode)
+count = 64
+workers = Etc.nprocessors
+
+Benchmark.bm(12) do |x|
+  x.report('sequential') { count.times { torrent.bdecode } }
+  x.report("#{workers} ractors") do
+    workers.times.map do
+      Ractor.new(torrent, count / workers) { |t, n| n.times { BEncode.decode(t, max_depth: 16) }; nil }
+    end.each(&:take)
+  end
+end
@@ -0,0 +1,13 @@
+# Decoding frozen torrent with 50MB of piece hashes and a few thousand
+# 4KB blobs, copying strings out (share: false) and sharing them.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+blobs = (0...5000).map { |i| i.to_s * (4096 / i.to_s.size) }
+torrent = {'info' => {'name' => 'big', 'pieces' => 'x' * 50_000_000}, 'blobs' => blobs}.bencode.freeze
+
+Benchmark.bm(5) do |x|
+  x.report('copy') { 20.times { torrent.bdecode(share: false) } }
+  x.report('share') { 20.times { torrent.bdecode } }
+end
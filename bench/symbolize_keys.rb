@@ -0,0 +1,24 @@
+# Symbol keyed decoding with symbolize_keys: compared to converting
+# keys of the decoded structure afterwards.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+def symbolize(obj)
+  case obj
+  when Hash then obj.each_with_object({}) { |(k, v), h| h[k.to_sym] = symbolize(v) }
+  when Array then obj.map { |v| symbolize(v) }
+  else obj
+  end
+end
+
+files = (0...20_000).map { |i| {'length' => i * 1024, 'path' => ['dir', "file#{i}.bin"]} }
+torrent = {'announce' => 'http://tracker/announce', 'info' => {'files' => files, 'name' => 'big'}}.bencode
+ping = {'t' => 'aa', 'y' => 'q', 'q' => 'ping', 'a' => {'id' => 'abcdefghij0123456789'}}.bencode
+
+Benchmark.bm(16) do |x|
+  x.report('torrent convert') { 10.times { symbolize(torrent.bdecode) } }
+  x.report('torrent option') { 10.times { torrent.bdecode(symbolize_keys: true) } }
+  x.report('ping convert') { 100_000.times { symbolize(ping.bdecode) } }
+  x.report('ping option') { 100_000.times { ping.bdecode(symbolize_keys: true) } }
+end
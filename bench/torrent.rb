@@ -0,0 +1,14 @@
+# Decoding of a 50k file torrent and of a small DHT message.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+files = (0...50_000).map { |i| {'length' => i * 1024, 'path' => ['dir', "file#{i}.bin"]} }
+torrent = {'announce' => 'http://tracker/announce',
+           'info' => {'files' => files, 'name' => 'big', 'piece length' => 262_144, 'pieces' => 'x' * 20 * 1000}}.bencode
+ping = {'t' => 'aa', 'y' => 'q', 'q' => 'ping', 'a' => {'id' => 'abcdefghij0123456789'}}.bencode
+
+Benchmark.bm(10) do |x|
+  x.report('torrent') { 20.times { torrent.bdecode } }
+  x.report('ping') { 200_000.times { ping.bdecode } }
+end
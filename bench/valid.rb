@@ -0,0 +1,18 @@
+# Accepting or rejecting input with BEncode.valid? (with and without
+# canonical form check) compared to decoding it just to see whether
+# it raises.
+$LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
+require 'benchmark'
+require 'bencode_ext'
+
+files = (0...50_000).map { |i| {'length' => i * 1024, 'path' => ['dir', "file#{i}.bin"]} }
+torrent = {'info' => {'files' => files, 'name' => 'big', 'pieces' => 'x' * 20 * 1000}}.bencode
+ping = {'t' => 'aa', 'y' => 'q', 'q' => 'ping', 'a' => {'id' => 'abcdefghij0123456789'}}.bencode
+
+Benchmark.bm(14) do |x|
+  x.report('torrent decode') { 20.times { torrent.bdecode } }
+  x.report('torrent valid?') { 20.times { BEncode.valid?(torrent) } }
+  x.report('torrent strict') { 20.times { BEncode.valid?(torrent, strict: true) } }
+  x.report('ping decode') { 200_000.times { ping.bdecode } }
+  x.report('ping valid?') { 200_000.times { BEncode.valid?(ping) } }
+end
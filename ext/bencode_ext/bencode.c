@@ -23,177 +23,3625 @@
 
 #include "bencode.h"
 
+#ifdef SWAR_DIGITS
+/* Number of leading ASCII digits in 8 bytes loaded into _chunk_ */
+static inline int swar_digits(uint64_t chunk){
+  uint64_t bad = ((chunk & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL) |
+                 (((chunk & 0x0F0F0F0F0F0F0F0FULL) + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL);
+
+  return bad ? __builtin_ctzll(bad) >> 3 : 8;
+}
+
+/* Value of first _n_ (1..8) digits of _chunk_ */
+static inline long swar_value(uint64_t chunk, int n){
+  chunk = (chunk & 0x0F0F0F0F0F0F0F0FULL) << (8 * (8 - n));
+  chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFULL;
+  chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFULL;
+  chunk = (chunk * 10000 + (chunk >> 32)) & 0xFFFFFFFFULL;
+  return (long)chunk;
+}
+#endif
+
+/*
+ * Parses optional minus and digits advancing _str_ and _len_.
+ * First SHORT_DIGITS digits are taken one by one since most length
+ * prefixes and integers are that short and can't overflow. Longer
+ * numbers are taken eight digits at once while there are eight bytes
+ * left (if SWAR is available). Values that don't fit into long
+ * saturate at LONG_MAX, use int_value to get exact integer.
+ */
+
 static long parse_num(char** str, long* len){
+#ifdef SWAR_DIGITS
+  static const long scale[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+#endif
   long t = 1, ret = 0;
+  char *p, *end, *lim;
+
+  if(!*len)
+    return 0;
+
+  if(**str == '-'){
+    t = -1;
+    ++*str;
+    --*len;
+  }
+
+  p = *str;
+  end = p + *len;
+  lim = end - p > SHORT_DIGITS ? p + SHORT_DIGITS : end;
+
+  while(p < lim && *p >= '0' && *p <= '9'){
+    ret = ret * 10 + (*p - '0');
+    ++p;
+  }
+
+  if(p == lim && p < end && *p >= '0' && *p <= '9'){
+#ifdef SWAR_DIGITS
+    while(end - p >= 8){
+      uint64_t chunk;
+      int n;
+
+      memcpy(&chunk, p, 8);
+      n = swar_digits(chunk);
+      if(!n)
+        goto done;
+
+      ret = ret > (LONG_MAX - 99999999) / scale[n] ? LONG_MAX : ret * scale[n] + swar_value(chunk, n);
+      p += n;
+      if(n < 8)
+        goto done;
+    }
+#endif
+
+    while(p < end && *p >= '0' && *p <= '9'){
+      ret = ret > (LONG_MAX - 9) / 10 ? LONG_MAX : ret * 10 + (*p - '0');
+      ++p;
+    }
+  }
+
+#ifdef SWAR_DIGITS
+done:
+#endif
+  *len -= p - *str;
+  *str = p;
+  return ret * t;
+}
+
+/*
+ * Dictionary key for _len_ bytes at _str_. Keys are frozen and
+ * deduplicated through Ruby's fstring table, so repeated keys share
+ * one object within and across decodes and no temporary string is
+ * allocated for keys seen before. Hash#[]= would dup and freeze
+ * plain strings anyway, so results are the same.
+ */
+
+static VALUE key_new(const char* str, long len){
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  return rb_enc_interned_str(str, len, rb_ascii8bit_encoding());
+#else
+  return rb_obj_freeze(rb_str_new(str, len));
+#endif
+}
+
+/*
+ * Symbol for dictionary key of _len_ bytes at _str_. Well-known
+ * keys are looked up in a table built on load, other keys which
+ * already exist as symbols are found without allocating anything.
+ * New keys become dynamic symbols, which are garbage collected,
+ * so untrusted input can't grow the symbol table forever.
+ */
+
+static VALUE key_sym(const char* str, long len){
+  VALUE ret;
+  int i;
+
+  for(i = 0; i < KNOWN_KEYS; ++i)
+    if(known_key_lens[i] == len && *known_keys[i] == *str && !memcmp(known_keys[i], str, len))
+      return known_key_syms[i];
+
+  ret = rb_check_symbol_cstr(str, len, rb_ascii8bit_encoding());
+  if(!NIL_P(ret))
+    return ret;
+
+  return rb_str_intern(rb_str_new(str, len));
+}
+
+/*
+ * Integer value of _len_ bytes at _str_ already parsed into _num_
+ * by parse_num. Numbers too long for long are converted with
+ * Ruby's own parser.
+ */
+
+static VALUE int_value(const char* str, long len, long num){
+  if(len - (len && *str == '-') <= LONG_DIGITS)
+    return LONG2NUM(num);
+
+  return rb_str_to_inum(rb_str_new(str, len), 10, Qfalse);
+}
+
+/*
+ * In _strict_ mode stack also keeps offset and length of the last
+ * key seen on every level to check order of dictionary keys.
+ */
+
+static void scan_stack_init(scan_stack* stack, int strict){
+  stack->ptr = stack->buf;
+  stack->size = 0;
+  stack->capa = SCAN_STACK_INLINE;
+  stack->strict = strict;
+  stack->keys = stack->keys_buf;
+}
+
+static int scan_stack_push(scan_stack* stack, char state){
+  if(stack->size == stack->capa){
+    long capa = stack->capa * 2;
+    char* ptr = stack->ptr == stack->buf ? malloc(capa) : realloc(stack->ptr, capa);
+
+    if(!ptr)
+      return 0;
+    if(stack->ptr == stack->buf)
+      memcpy(ptr, stack->buf, stack->size);
+    stack->ptr = ptr;
+
+    if(stack->strict){
+      long* keys = tape_grow(stack->keys, stack->keys_buf, stack->capa * 2, sizeof(long));
+
+      if(!keys)
+        return 0;
+      stack->keys = keys;
+    }
+
+    stack->capa = capa;
+  }
+
+  if(stack->strict)
+    stack->keys[stack->size * 2] = -1;
+  stack->ptr[stack->size++] = state;
+  return 1;
+}
+
+static void scan_stack_free(scan_stack* stack){
+  if(stack->ptr != stack->buf)
+    free(stack->ptr);
+  if(stack->keys != stack->keys_buf)
+    free(stack->keys);
+  scan_stack_init(stack, stack->strict);
+}
+
+static void tape_init(btape* tape){
+  tape->ptr = tape->buf;
+  tape->size = 0;
+  tape->capa = TAPE_INLINE;
+  tape->levels = tape->levels_buf;
+  tape->depth = 0;
+  tape->levels_capa = SCAN_STACK_INLINE;
+  tape->interrupt = NULL;
+}
+
+/*
+ * Moves _capa_ items of _width_ bytes from _ptr_ to heap block twice
+ * as big, _buf_ is the inline buffer _ptr_ starts with.
+ */
+
+static void* tape_grow(void* ptr, void* buf, long capa, size_t width){
+  void* ret = ptr == buf ? malloc(capa * 2 * width) : realloc(ptr, capa * 2 * width);
+
+  if(ret && ptr == buf)
+    memcpy(ret, buf, capa * width);
+  return ret;
+}
+
+#define TOKEN_TYPE(tok) ((int)((tok)->info & ((1 << TAPE_SHIFT) - 1)))
+#define TOKEN_LEN(tok) ((tok)->info >> TAPE_SHIFT)
+
+/*
+ * Appends token to _tape_, returns error code on failure. Every
+ * TAPE_POLL tokens it checks whether tape is built without GVL and
+ * somebody wants the thread back.
+ * Token is a byte offset plus type and length packed together.
+ * Length of container start token is index of its end token, so
+ * whole subtree can be skipped at once, length of end token is
+ * number of children (keys and values for dictionaries). Integers
+ * fitting into long keep their value instead of offset.
+ */
+
+static int tape_add(btape* tape, int type, long pos, long len){
+  btoken* tok;
+
+  if(!(tape->size & TAPE_POLL) && tape->interrupt && *tape->interrupt)
+    return DECODE_E_INTERRUPT;
+
+  if(tape->size == tape->capa){
+    btoken* ptr = tape_grow(tape->ptr, tape->buf, tape->capa, sizeof(btoken));
+
+    if(!ptr)
+      return DECODE_E_NOMEM;
+    tape->ptr = ptr;
+    tape->capa *= 2;
+  }
+
+  if(type == TAPE_END){
+    tape_level* level = &tape->levels[--tape->depth];
+
+    tape->ptr[level->open].info |= tape->size << TAPE_SHIFT;
+    len = level->count;
+  }else{
+    if(tape->depth)
+      ++tape->levels[tape->depth - 1].count;
+
+    if(type == TAPE_LIST || type == TAPE_DICT){
+      if(tape->depth == tape->levels_capa){
+        tape_level* levels = tape_grow(tape->levels, tape->levels_buf, tape->levels_capa, sizeof(tape_level));
+
+        if(!levels)
+          return DECODE_E_NOMEM;
+        tape->levels = levels;
+        tape->levels_capa *= 2;
+      }
+
+      tape->levels[tape->depth].open = tape->size;
+      tape->levels[tape->depth++].count = 0;
+      len = 0;
+    }
+  }
+
+  tok = &tape->ptr[tape->size++];
+  tok->pos = pos;
+  tok->info = len << TAPE_SHIFT | type;
+  return DECODE_OK;
+}
+
+static void tape_free(btape* tape){
+  if(tape->ptr != tape->buf)
+    free(tape->ptr);
+  if(tape->levels != tape->levels_buf)
+    free(tape->levels);
+  tape_init(tape);
+}
+
+static long scan_fail(scan_error* err, int code, const char* str, long len, long pos){
+  err->code = code;
+  err->pos = pos;
+  err->ch = pos < len ? str[pos] : 0;
+  return -1;
+}
+
+/*
+ * Checks that key of _len_ bytes at _pos_ goes strictly after the
+ * previous key of the innermost dictionary and remembers it.
+ */
+
+static int scan_key_check(scan_stack* stack, const char* str, long pos, long len){
+  long* prev = &stack->keys[(stack->size - 1) * 2];
+
+  if(prev[0] != -1){
+    int cmp = memcmp(str + prev[0], str + pos, prev[1] < len ? prev[1] : len);
+
+    if(!cmp && prev[1] == len)
+      return DECODE_E_KEY_DUP;
+    if(cmp > 0 || (!cmp && prev[1] > len))
+      return DECODE_E_KEY_ORDER;
+  }
+
+  prev[0] = pos;
+  prev[1] = len;
+  return DECODE_OK;
+}
+
+#define SCAN_LIST 'l'
+#define SCAN_KEY 'k'
+#define SCAN_VALUE 'v'
+
+/*
+ * Walks one bencoded value starting at _pos_ without building anything.
+ * Returns offset right after the value or -1 with _err_ filled in.
+ * Unlike decode this never raises by itself, so it can be used for
+ * validation and for finding value boundaries. If _events_ is given
+ * every token is reported to it as it's recognized, if _tape_ is
+ * given tokens are recorded there. Strict stack makes it reject
+ * anything but canonical encoding: integers and lengths with
+ * leading zeros, negative zero, empty integers and unsorted or
+ * repeated dictionary keys.
+ */
+
+static long scan_run(scan_stack* stack, const char* str, long len, long pos, long depth, const scan_events* events, btape* tape, scan_error* err){
+  int code;
+
+  while(pos < len){
+    char* top = stack->size ? &stack->ptr[stack->size - 1] : NULL;
+
+    if(top && *top == SCAN_KEY && (str[pos] == 'l' || str[pos] == 'd' || str[pos] == 'i'))
+      return scan_fail(err, DECODE_E_KEY, str, len, pos);
+
+    switch(str[pos]){
+      case 'l':
+      case 'd':
+        if(depth != -1 && stack->size >= depth)
+          return scan_fail(err, DECODE_E_DEPTH, str, len, pos);
+        if(!scan_stack_push(stack, str[pos] == 'l' ? SCAN_LIST : SCAN_KEY))
+          return scan_fail(err, DECODE_E_NOMEM, str, len, pos);
+        if(tape && (code = tape_add(tape, str[pos] == 'l' ? TAPE_LIST : TAPE_DICT, pos, 0)))
+          return scan_fail(err, code, str, len, pos);
+        if(events)
+          events->fn(events->ctx, str[pos] == 'l' ? EVENT_LIST : EVENT_DICT, NULL, 0);
+        ++pos;
+        continue;
+      case 'i':{
+        char* p = (char*)str + pos + 1;
+        long rem = len - pos - 1;
+
+        long num = parse_num(&p, &rem);
+
+        if(!rem)
+          return scan_fail(err, DECODE_E_INT_END, str, len, len);
+        if(*p != 'e')
+          return scan_fail(err, DECODE_E_INT, str, len, len - rem);
+        if(stack->strict){
+          const char* d = str + pos + 1 + (str[pos + 1] == '-');
+
+          if(d == p || (*d == '0' && (p - d > 1 || d[-1] == '-')))
+            return scan_fail(err, DECODE_E_CANON_INT, str, len, pos);
+        }
+        if(tape){
+          long digits = p - str - pos - 1;
+          int big = digits - (str[pos + 1] == '-') > LONG_DIGITS;
+
+          if((code = tape_add(tape, big ? TAPE_BIGNUM : TAPE_INT, big ? pos + 1 : num, digits)))
+            return scan_fail(err, code, str, len, pos);
+        }
+        if(events)
+          events->fn(events->ctx, EVENT_INT, str + pos + 1, p - str - pos - 1);
+
+        pos = len - rem + 1;
+        break;
+      }
+      case '0'...'9':{
+        char* p = (char*)str + pos;
+        long rem = len - pos, slen = parse_num(&p, &rem);
+
+        if(rem && *p != ':')
+          return scan_fail(err, DECODE_E_STR_LEN, str, len, len - rem);
+        if(!rem || rem <= slen)
+          return scan_fail(err, DECODE_E_STR_END, str, len, len);
+        if(stack->strict){
+          if(str[pos] == '0' && p - str - pos > 1)
+            return scan_fail(err, DECODE_E_CANON_LEN, str, len, pos);
+          if(top && *top == SCAN_KEY && (code = scan_key_check(stack, str, p + 1 - str, slen)))
+            return scan_fail(err, code, str, len, pos);
+        }
+        if(tape && (code = tape_add(tape, top && *top == SCAN_KEY ? TAPE_KEY : TAPE_STRING, p + 1 - str, slen)))
+          return scan_fail(err, code, str, len, pos);
+        if(events)
+          events->fn(events->ctx, top && *top == SCAN_KEY ? EVENT_KEY : EVENT_STRING, p + 1, slen);
+
+        pos = len - rem + 1 + slen;
+        break;
+      }
+      case 'e':
+        if(!top || *top == SCAN_VALUE)
+          return scan_fail(err, DECODE_E_CONT_END, str, len, pos);
+        if(tape && (code = tape_add(tape, TAPE_END, pos, 0)))
+          return scan_fail(err, code, str, len, pos);
+        if(events)
+          events->fn(events->ctx, EVENT_END, NULL, 0);
+        --stack->size;
+        ++pos;
+        break;
+      default:
+        return scan_fail(err, DECODE_E_UNKNOWN, str, len, pos);
+    }
+
+    if(!stack->size)
+      return pos;
+
+    top = &stack->ptr[stack->size - 1];
+    if(*top != SCAN_LIST)
+      *top = *top == SCAN_KEY ? SCAN_VALUE : SCAN_KEY;
+  }
+
+  scan_fail(err, DECODE_E_EOF, str, len, len);
+  err->ch = stack->size && stack->ptr[stack->size - 1] == SCAN_LIST ? 'l' : 'd';
+  return -1;
+}
+
+static long scan_value(const char* str, long len, long pos, long depth, scan_error* err){
+  scan_stack stack;
+  long ret;
+
+  scan_stack_init(&stack, 0);
+  ret = scan_run(&stack, str, len, pos, depth, NULL, NULL, err);
+  scan_stack_free(&stack);
+  return ret;
+}
+
+/*
+ * DecodeError instance describing _err_. Running out of memory is
+ * not a property of input, so NoMemoryError is raised right away.
+ */
+
+static VALUE decode_error_new(const scan_error* err){
+  switch(err->code){
+    case DECODE_E_INT_END:
+      return rb_exc_new_cstr(DecodeError, "Unpexpected integer end!");
+    case DECODE_E_INT:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Mailformed integer at %ld byte: %c", err->pos, err->ch));
+    case DECODE_E_STR_LEN:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Invalid string length specification at %ld: %c", err->pos, err->ch));
+    case DECODE_E_STR_END:
+      return rb_exc_new_cstr(DecodeError, "Unexpected string end!");
+    case DECODE_E_CONT_END:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Unexpected container end at %ld!", err->pos));
+    case DECODE_E_UNKNOWN:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Unknown element type at %ld: %c!", err->pos, err->ch));
+    case DECODE_E_KEY:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Dictionary key must be a string (at %ld)!", err->pos));
+    case DECODE_E_DEPTH:
+      return rb_exc_new_cstr(DecodeError, "Structure is too deep!");
+    case DECODE_E_GARBAGE:
+      return rb_exc_new_str(DecodeError, rb_sprintf("String has garbage on the end (starts at %ld).", err->pos));
+    case DECODE_E_EOF:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Unpexpected end of %s.", err->ch == 'd' ? "dictionary" : "list"));
+    case DECODE_E_CANON_INT:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Non-canonical integer at %ld.", err->pos));
+    case DECODE_E_CANON_LEN:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Non-canonical string length at %ld.", err->pos));
+    case DECODE_E_KEY_ORDER:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Dictionary keys are not sorted (at %ld)!", err->pos));
+    case DECODE_E_KEY_DUP:
+      return rb_exc_new_str(DecodeError, rb_sprintf("Duplicate dictionary key at %ld!", err->pos));
+    case DECODE_E_NOMEM:
+      rb_memerror();
+  }
+
+  return rb_exc_new_str(DecodeError, rb_sprintf("Unknown decoding error at %ld.", err->pos));
+}
+
+static void raise_decode_error(const scan_error* err){
+  rb_exc_raise(decode_error_new(err));
+}
+
+static void value_stack_init(value_stack* stack){
+  stack->ptr = stack->buf;
+  stack->size = 0;
+  stack->capa = VALUE_STACK_INLINE;
+  stack->tmp = 0;
+}
+
+/*
+ * Stack of containers being filled by decode. First VALUE_STACK_INLINE
+ * levels live on the C stack, deeper ones in a GC managed temporary
+ * buffer, so nothing leaks if decoding raises halfway. Every container
+ * is already attached to its parent, so they're all reachable from the
+ * result anyway.
+ */
+
+static void value_stack_push(value_stack* stack, VALUE val){
+  if(stack->size == stack->capa){
+    volatile VALUE tmp = 0;
+    VALUE* ptr = rb_alloc_tmp_buffer(&tmp, stack->capa * 2 * sizeof(VALUE));
+
+    MEMCPY(ptr, stack->ptr, VALUE, stack->size);
+    if(stack->tmp)
+      rb_free_tmp_buffer(&stack->tmp);
+
+    stack->ptr = ptr;
+    stack->tmp = tmp;
+    stack->capa *= 2;
+  }
+
+  stack->ptr[stack->size++] = val;
+}
+
+static void value_stack_free(value_stack* stack){
+  if(stack->tmp)
+    rb_free_tmp_buffer(&stack->tmp);
+  value_stack_init(stack);
+}
+
+/*
+ * Key paths of only: and except: options are kept as tries in
+ * _opts->paths_, every node refers its parent and root nodes have
+ * no key. Tries are tiny so children are looked up by linear search.
+ */
+
+static long path_child(const decode_opts* opts, long parent, const char* key, long len){
+  long i;
+
+  for(i = parent + 1; i < opts->path_count; ++i){
+    const path_node* node = &opts->paths[i];
+
+    if(node->parent == parent && RSTRING_LEN(node->key) == len && !memcmp(RSTRING_PTR(node->key), key, len))
+      return i;
+  }
+
+  return -1;
+}
+
+static long path_node_add(decode_opts* opts, long parent, VALUE key){
+  path_node* node;
+
+  if(opts->path_count == PATH_NODES)
+    rb_raise(rb_eArgError, "too many key paths (at most %d keys)", PATH_NODES);
+
+  node = &opts->paths[opts->path_count];
+  node->key = key;
+  node->parent = parent;
+  node->leaf = 0;
+  node->klass = Qnil;
+  node->members = Qnil;
+  node->data = 0;
+  return opts->path_count++;
+}
+
+/*
+ * Adds _path_ below _root_, returns its last node.
+ */
+
+static long path_add(decode_opts* opts, long root, VALUE path){
+  VALUE parts;
+  long i, node = root;
+
+  if(SYMBOL_P(path))
+    path = rb_sym2str(path);
+  if(RB_TYPE_P(path, T_STRING))
+    parts = rb_str_split(path, ".");
+  else if(NIL_P(parts = rb_check_array_type(path)))
+    rb_raise(rb_eTypeError, "key path should be String or Array");
+
+  for(i = 0; i < RARRAY_LEN(parts); ++i){
+    VALUE key = RARRAY_AREF(parts, i);
+    long child;
+
+    if(SYMBOL_P(key))
+      key = rb_sym2str(key);
+    StringValue(key);
+
+    if((child = path_child(opts, node, RSTRING_PTR(key), RSTRING_LEN(key))) == -1)
+      child = path_node_add(opts, node, key);
+    node = child;
+  }
+
+  return node;
+}
+
+static void path_leaf(decode_opts* opts, long root, VALUE path){
+  long node = path_add(opts, root, path);
+
+  if(node == root)
+    rb_raise(rb_eArgError, "empty key path");
+  opts->paths[node].leaf = 1;
+}
+
+/*
+ * Adds trie for path list _paths_ (or a single path) to _opts_,
+ * returns index of its root.
+ */
+
+static long path_compile(decode_opts* opts, VALUE paths){
+  long i, root = path_node_add(opts, -1, Qnil);
+
+  if(RB_TYPE_P(paths, T_ARRAY)){
+    for(i = 0; i < RARRAY_LEN(paths); ++i)
+      path_leaf(opts, root, RARRAY_AREF(paths, i));
+  }else{
+    path_leaf(opts, root, paths);
+  }
+
+  return root;
+}
+
+/*
+ * Binds Struct or Data _klass_ to trie _node_. Member names are
+ * resolved to strings here once, so keys are matched by bytes.
+ */
+
+static void path_class(decode_opts* opts, long node, VALUE klass){
+  path_node* n = &opts->paths[node];
+  VALUE members;
+  long i;
+
+  n->data = !NIL_P(DataClass) && RB_TYPE_P(klass, T_CLASS) && RTEST(rb_class_inherited_p(klass, DataClass));
+  if(!n->data && (!RB_TYPE_P(klass, T_CLASS) || !RTEST(rb_class_inherited_p(klass, rb_cStruct))))
+    rb_raise(rb_eTypeError, "Struct or Data class expected");
+
+  members = rb_struct_s_members(klass);
+  n->klass = klass;
+  n->members = rb_ary_new_capa(RARRAY_LEN(members));
+  for(i = 0; i < RARRAY_LEN(members); ++i)
+    rb_ary_push(n->members, rb_sym2str(RARRAY_AREF(members, i)));
+}
+
+static int path_class_i(VALUE path, VALUE klass, VALUE ptr){
+  decode_opts* opts = (decode_opts*)ptr;
+
+  path_class(opts, path_add(opts, opts->as, path), klass);
+  return ST_CONTINUE;
+}
+
+/*
+ * Compiles as: option, either class for the top level value or
+ * Hash of key paths and classes.
+ */
+
+static long path_map(decode_opts* opts, VALUE as){
+  opts->as = path_node_add(opts, -1, Qnil);
+
+  if(RB_TYPE_P(as, T_HASH))
+    rb_hash_foreach(as, path_class_i, (VALUE)opts);
+  else
+    path_class(opts, opts->as, as);
+
+  return opts->as;
+}
+
+/*
+ * Returns index of Struct member named _key_ of mapped _node_ or -1.
+ */
+
+static long member_find(const path_node* node, const char* key, long len){
+  long i;
+
+  for(i = 0; i < RARRAY_LEN(node->members); ++i){
+    VALUE name = RARRAY_AREF(node->members, i);
+
+    if(RSTRING_LEN(name) == len && !memcmp(RSTRING_PTR(name), key, len))
+      return i;
+  }
+
+  return -1;
+}
+
+/*
+ * Decides whether dictionary entry with _key_ is decoded. _only_ and
+ * _except_ are trie nodes of the dictionary, -1 stands for subtree
+ * without restrictions. On success they're replaced with nodes
+ * for the value.
+ */
+
+static int path_match(const decode_opts* opts, const char* key, long len, long* only, long* except){
+  long node;
+
+  if(*except != -1){
+    node = path_child(opts, *except, key, len);
+    if(node != -1 && opts->paths[node].leaf)
+      return 0;
+    *except = node;
+  }
+
+  if(*only != -1){
+    node = path_child(opts, *only, key, len);
+    if(node == -1)
+      return 0;
+    *only = opts->paths[node].leaf ? -1 : node;
+  }
+
+  return 1;
+}
+
+static void decode_opts_parse(decode_opts* opts, VALUE hash){
+  VALUE values[DECODE_OPT_COUNT];
+
+  opts->presize = 0;
+  opts->strict = 0;
+  opts->symbolize_keys = 0;
+  opts->piece_list = 0;
+  opts->share = 0;
+  opts->freeze = 0;
+  opts->depth = max_depth;
+  opts->nogvl = nogvl_threshold;
+  opts->only = -1;
+  opts->except = -1;
+  opts->as = -1;
+  opts->path_count = 0;
+  if(NIL_P(hash))
+    return;
+
+  rb_get_kwargs(hash, decode_opt_ids, 0, DECODE_OPT_COUNT, values);
+  if(values[DECODE_OPT_PRESIZE] != Qundef)
+    opts->presize = RTEST(values[DECODE_OPT_PRESIZE]);
+  if(values[DECODE_OPT_STRICT] != Qundef)
+    opts->strict = RTEST(values[DECODE_OPT_STRICT]);
+  if(values[DECODE_OPT_SYMBOLIZE_KEYS] != Qundef)
+    opts->symbolize_keys = RTEST(values[DECODE_OPT_SYMBOLIZE_KEYS]);
+  if(values[DECODE_OPT_PIECE_LIST] != Qundef)
+    opts->piece_list = RTEST(values[DECODE_OPT_PIECE_LIST]);
+  if(values[DECODE_OPT_SHARE] != Qundef)
+    opts->share = RTEST(values[DECODE_OPT_SHARE]);
+  if(values[DECODE_OPT_FREEZE] != Qundef)
+    opts->freeze = RTEST(values[DECODE_OPT_FREEZE]);
+  if(values[DECODE_OPT_MAX_DEPTH] != Qundef)
+    opts->depth = limit_value(values[DECODE_OPT_MAX_DEPTH], "Depth");
+  if(values[DECODE_OPT_NOGVL_THRESHOLD] != Qundef)
+    opts->nogvl = limit_value(values[DECODE_OPT_NOGVL_THRESHOLD], "Threshold");
+  if(values[DECODE_OPT_ONLY] != Qundef && !NIL_P(values[DECODE_OPT_ONLY]))
+    opts->only = path_compile(opts, values[DECODE_OPT_ONLY]);
+  if(values[DECODE_OPT_EXCEPT] != Qundef && !NIL_P(values[DECODE_OPT_EXCEPT]))
+    opts->except = path_compile(opts, values[DECODE_OPT_EXCEPT]);
+  if(values[DECODE_OPT_AS] != Qundef && !NIL_P(values[DECODE_OPT_AS]))
+    path_map(opts, values[DECODE_OPT_AS]);
+}
+
+/*
+ * Dictionary pairs are collected in a small buffer living on the C
+ * stack (so GC sees them) and inserted in bulk when it's full or when
+ * decoder moves to another container.
+ */
+
+static void pairs_flush(pending_pairs* pairs, VALUE hash){
+  if(!pairs->size)
+    return;
+
+#ifdef HAVE_RB_HASH_BULK_INSERT
+  rb_hash_bulk_insert(pairs->size, pairs->buf, hash);
+#else
+  {
+    long i;
+    for(i = 0; i < pairs->size; i += 2)
+      rb_hash_aset(hash, pairs->buf[i], pairs->buf[i + 1]);
+  }
+#endif
+
+  pairs->size = 0;
+}
+
+static void pairs_add(pending_pairs* pairs, VALUE hash, VALUE key, VALUE val){
+  pairs->buf[pairs->size++] = key;
+  pairs->buf[pairs->size++] = val;
+  if(pairs->size == PENDING_PAIRS * 2)
+    pairs_flush(pairs, hash);
+}
+
+/*
+ * First decoding stage: validates _len_ bytes at _str_ recording
+ * every token into _tape_. Returns -1 with _err_ filled in if input
+ * is malformed. Never touches Ruby objects, so it may run without GVL.
+ */
+
+static long tape_build(btape* tape, const char* str, long len, long depth, int strict, scan_error* err){
+  scan_stack stack;
+  long end;
+
+  scan_stack_init(&stack, strict);
+  end = scan_run(&stack, str, len, 0, depth, NULL, tape, err);
+  scan_stack_free(&stack);
+
+  if(end != -1 && end != len)
+    return scan_fail(err, DECODE_E_GARBAGE, str, len, end);
+  return end;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void* tape_build_nogvl(void* ptr){
+  tape_job* job = ptr;
+
+  job->end = tape_build(job->tape, job->str, job->len, job->depth, job->strict, &job->err);
+  return NULL;
+}
+
+static void tape_build_ubf(void* ptr){
+  ((tape_job*)ptr)->interrupted = 1;
+}
+#endif
+
+/*
+ * Builds tape for frozen _src_ letting other threads run meanwhile.
+ * If the thread is interrupted tape is dropped, pending interrupts
+ * are processed (which may raise) and building starts over.
+ */
+
+static long tape_build_unlocked(btape* tape, VALUE src, long depth, int strict, scan_error* err){
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  tape_job job;
+
+  job.tape = tape;
+  job.str = RSTRING_PTR(src);
+  job.len = RSTRING_LEN(src);
+  job.depth = depth;
+  job.strict = strict;
+
+  for(;;){
+    job.end = -1;
+    job.err.code = DECODE_E_INTERRUPT;
+    job.interrupted = 0;
+    tape->interrupt = &job.interrupted;
+
+    rb_thread_call_without_gvl(tape_build_nogvl, &job, tape_build_ubf, &job);
+    tape->interrupt = NULL;
+
+    if(job.end != -1 || job.err.code != DECODE_E_INTERRUPT){
+      *err = job.err;
+      return job.end;
+    }
+
+    tape_free(tape);
+    rb_thread_check_ints();
+  }
+#else
+  return tape_build(tape, RSTRING_PTR(src), RSTRING_LEN(src), depth, strict, err);
+#endif
+}
+
+/*
+ * Second decoding stage: turns tape into Ruby objects. Input is
+ * known to be valid here, so there are no checks left, and every
+ * container is created at its final size.
+ */
+
+/*
+ * Returns String pointing to _len_ bytes at _pos_ of frozen _owner_,
+ * writing to the String makes its own copy first. Bytes belong to
+ * a static String holding _owner_ in its ivar the way memory mapped
+ * files are held, returned String is its plain shared substring, so
+ * dup and Marshal see just the bytes.
+ */
+
+static VALUE str_share(VALUE owner, long pos, long len){
+  VALUE root = rb_str_new_static(RSTRING_PTR(owner) + pos, len);
+
+  rb_ivar_set(root, mappingId, owner);
+  rb_obj_freeze(root);
+  return rb_str_subseq(root, 0, len);
+}
+
+/*
+ * Returns frozen String that shared values and piece lists of _src_
+ * point into. Deeply frozen results need it to be shareable too, if
+ * it isn't (frozen input with ivars of its own) its bytes get copied.
+ */
+
+static VALUE share_owner(VALUE src, int freeze){
+  VALUE ret = rb_str_new_frozen(src);
+
+  if(freeze && !rb_ractor_shareable_p(ret))
+    ret = value_freeze(rb_str_new(RSTRING_PTR(src), RSTRING_LEN(src)));
+  return ret;
+}
+
+/*
+ * Freezes _val_ and marks it as shareable between Ractors. Values
+ * are frozen bottom up, so once container is done everything it
+ * refers is already shareable and nothing has to be traversed again.
+ */
+
+static VALUE value_freeze(VALUE val){
+  rb_obj_freeze(val);
+  OBJ_SHAREABLE(val);
+  return val;
+}
+
+static VALUE tape_decode(VALUE ptr){
+  decode_ctx* ctx = (decode_ctx*)ptr;
+  const char* str = RSTRING_PTR(ctx->src);
+  const btoken *tape = ctx->tape->ptr, *tok = tape, *end = tape + ctx->tape->size;
+  value_stack stack;
+  pending_pairs pairs;
+  volatile VALUE ret = Qnil;
+  const decode_opts* opts = ctx->opts;
+  VALUE container = Qnil, key = Qnil, frozen = Qnil, val;
+  int type, symbolize = opts && opts->symbolize_keys, pieces = opts && opts->piece_list;
+  int freeze = opts && opts->freeze;
+  int track = opts && (opts->only != -1 || opts->except != -1 || opts->as != -1);
+  long only = track ? opts->only : -1, except = track ? opts->except : -1, as = track ? opts->as : -1;
+  long key_only = -1, key_except = -1, key_as = -1, member = -1, node;
+
+  value_stack_init(&stack);
+  pairs.size = 0;
+
+  for(; tok < end; ++tok){
+    switch(type = TOKEN_TYPE(tok)){
+      case TAPE_LIST:
+        val = rb_ary_new_capa(TOKEN_LEN(tape + TOKEN_LEN(tok)));
+        break;
+      case TAPE_DICT:
+        if(track && (node = NIL_P(container) || BUILTIN_TYPE(container) == T_ARRAY ? as : key_as) != -1 &&
+           !NIL_P(opts->paths[node].klass))
+          val = rb_struct_alloc_noinit(opts->paths[node].klass);
+        else
+          val = HASH_NEW_CAPA(TOKEN_LEN(tape + TOKEN_LEN(tok)) / 2);
+        break;
+      case TAPE_KEY:
+        if(track){
+          key_only = only;
+          key_except = except;
+          key_as = as != -1 ? path_child(opts, as, str + tok->pos, TOKEN_LEN(tok)) : -1;
+          if(!path_match(opts, str + tok->pos, TOKEN_LEN(tok), &key_only, &key_except) ||
+             (BUILTIN_TYPE(container) == T_STRUCT &&
+              (member = member_find(&opts->paths[as], str + tok->pos, TOKEN_LEN(tok))) == -1)){
+            ++tok;
+            if(TOKEN_TYPE(tok) == TAPE_LIST || TOKEN_TYPE(tok) == TAPE_DICT)
+              tok = tape + TOKEN_LEN(tok);
+            continue;
+          }
+          if(BUILTIN_TYPE(container) == T_STRUCT)
+            continue;
+        }
+        key = symbolize ? key_sym(str + tok->pos, TOKEN_LEN(tok)) : key_new(str + tok->pos, TOKEN_LEN(tok));
+        continue;
+      case TAPE_STRING:
+        if(pieces && tok > tape && TOKEN_TYPE(tok - 1) == TAPE_KEY && !(TOKEN_LEN(tok) % PIECE_DIGEST) &&
+           TOKEN_LEN(tok - 1) == 6 && !memcmp(str + tok[-1].pos, "pieces", 6)){
+          if(NIL_P(frozen))
+            frozen = share_owner(ctx->src, freeze);
+          val = pieces_new(frozen, tok->pos, TOKEN_LEN(tok));
+        }else if(ctx->share && TOKEN_LEN(tok) >= SHARE_THRESHOLD){
+          if(NIL_P(frozen))
+            frozen = share_owner(ctx->src, freeze);
+          val = str_share(frozen, tok->pos, TOKEN_LEN(tok));
+        }else{
+          val = rb_str_new(str + tok->pos, TOKEN_LEN(tok));
+        }
+        if(freeze)
+          value_freeze(val);
+        break;
+      case TAPE_INT:
+        val = LONG2NUM(tok->pos);
+        break;
+      case TAPE_BIGNUM:
+        val = int_value(str + tok->pos, TOKEN_LEN(tok), LONG_MAX);
+        break;
+      default:
+        if(BUILTIN_TYPE(container) == T_HASH)
+          pairs_flush(&pairs, container);
+        else if(BUILTIN_TYPE(container) == T_STRUCT && opts->paths[as].data)
+          rb_obj_freeze(container);
+        if(freeze)
+          value_freeze(container);
+        container = stack.size ? stack.ptr[--stack.size] : Qnil;
+        if(track && stack.size){
+          as = FIX2LONG(stack.ptr[--stack.size]);
+          except = FIX2LONG(stack.ptr[--stack.size]);
+          only = FIX2LONG(stack.ptr[--stack.size]);
+        }
+        continue;
+    }
+
+    if(NIL_P(container))
+      ret = val;
+    else if(BUILTIN_TYPE(container) == T_ARRAY)
+      rb_ary_push(container, val);
+    else if(BUILTIN_TYPE(container) == T_HASH)
+      pairs_add(&pairs, container, key, val);
+    else
+      RSTRUCT_SET(container, (int)member, val);
+
+    if(type == TAPE_LIST || type == TAPE_DICT){
+      if(!NIL_P(container)){
+        if(track){
+          value_stack_push(&stack, LONG2FIX(only));
+          value_stack_push(&stack, LONG2FIX(except));
+          value_stack_push(&stack, LONG2FIX(as));
+        }
+        if(BUILTIN_TYPE(container) == T_HASH)
+          pairs_flush(&pairs, container);
+        if(track && BUILTIN_TYPE(container) != T_ARRAY){
+          only = key_only;
+          except = key_except;
+          as = key_as;
+        }
+        value_stack_push(&stack, container);
+      }
+      container = val;
+    }
+  }
+
+  value_stack_free(&stack);
+  return ret;
+}
+
+static VALUE decode_cleanup(VALUE ptr){
+  tape_free(((decode_ctx*)ptr)->tape);
+  return Qnil;
+}
+
+static VALUE decode_string(VALUE encoded, const decode_opts* opts){
+  btape tape;
+
+  tape_init(&tape);
+  return decode_tape(encoded, opts, &tape, 0);
+}
+
+/*
+ * Decodes _encoded_ building its tokens into empty _tape_. Tape is
+ * freed afterwards unless caller _keep_s it for the next call.
+ */
+
+static VALUE decode_tape(VALUE encoded, const decode_opts* opts, btape* tape, int keep){
+  decode_ctx ctx;
+  scan_error err;
+  long end, depth = opts ? opts->depth : max_depth, nogvl = opts ? opts->nogvl : nogvl_threshold;
+
+  if(!rb_obj_is_kind_of(encoded, rb_cString))
+    rb_raise(rb_eTypeError, "String expected");
+
+  if(!RSTRING_LEN(encoded))
+    return Qnil;
+
+  ctx.src = encoded;
+  ctx.tape = tape;
+  ctx.opts = opts;
+  ctx.share = opts && opts->share;
+  if(nogvl != -1 && RSTRING_LEN(encoded) >= nogvl){
+    ctx.src = rb_str_new_frozen(encoded);
+    end = tape_build_unlocked(tape, ctx.src, depth, opts && opts->strict, &err);
+  }else{
+    end = tape_build(tape, RSTRING_PTR(encoded), RSTRING_LEN(encoded), depth, opts && opts->strict, &err);
+  }
+
+  if(end == -1){
+    if(!keep)
+      tape_free(tape);
+    raise_decode_error(&err);
+  }
+
+  if(keep || tape->ptr == tape->buf)
+    return tape_decode((VALUE)&ctx);
+
+  return rb_ensure(tape_decode, (VALUE)&ctx, decode_cleanup, (VALUE)&ctx);
+}
+
+/*
+ * Document-method: BEncode.decode
+ * call-seq:
+ *     BEncode.decode(string, options = {})
+ *
+ * Returns data structure from parsed _string_.
+ * String must be valid bencoded data, or
+ * BEncode::DecodeError will be raised with description
+ * of error.
+ *
+ * Options:
+ *
+ * [:presize] accepted for compatibility, every Array and Hash
+ *            is allocated at its final size anyway.
+ * [:strict]  accept only canonical encoding: no leading zeros
+ *            in integers and string lengths, no negative zero,
+ *            dictionary keys sorted as raw strings and unique.
+ *            Such input is the only valid encoding of its data,
+ *            so its bytes can be hashed or compared directly.
+ * [:symbolize_keys] return dictionary keys as Symbols. Common
+ *            torrent, tracker and DHT keys are resolved without
+ *            allocating anything.
+ * [:only]    key path or Array of key paths, only dictionary
+ *            entries on these paths are decoded, everything
+ *            below path end is kept.
+ * [:except]  key path or Array of key paths to leave out.
+ * [:piece_list] return _pieces_ entries as BEncode::PieceList
+ *            instead of String. It refers decoded string
+ *            instead of copying digests out of it.
+ * [:as]      Struct or Data class to build from the top level
+ *            dictionary, or Hash of key paths and classes for
+ *            nested ones ('' is the top level). Members are
+ *            assigned directly, initialize is not called, keys
+ *            that are not members are skipped, missing members
+ *            are nil.
+ * [:share]   return Strings of 1KB and more as views into the
+ *            input instead of copies, bytes get copied only
+ *            if String is modified. Such String keeps whole
+ *            input (or file mapping) in memory. Strings
+ *            shared with memory mapped file read it directly,
+ *            so the file must not shrink while they're alive,
+ *            reading past its new end kills the process with
+ *            SIGBUS.
+ * [:max_depth] maximum nesting depth, nil for no limit.
+ *            Defaults to BEncode.max_depth.
+ * [:nogvl_threshold] input size starting from which GVL is
+ *            released while validating, nil to never release
+ *            it. Defaults to BEncode.nogvl_threshold.
+ * [:freeze]  return deeply frozen data: every String, Array,
+ *            Hash and Struct is frozen as soon as it's built.
+ *            Result is already shareable between Ractors,
+ *            Ractor.make_shareable doesn't need to walk it.
+ *
+ * Key path is either String with keys separated by dots
+ * or Array of keys. Lists on the path are transparent, path
+ * applies to every dictionary inside them. Skipped values
+ * are still validated but never allocated.
+ *
+ * Examples:
+ *
+ *    BEncode.decode('i1e') => 1
+ *    BEncode.decode('i-1e') => -1
+ *    BEncode.decode('6:string') => 'string'
+ *    BEncode.decode(torrent, except: ['info.pieces', 'info.files.path'])
+ *    BEncode.decode(torrent, only: ['announce', ['info', 'piece length']])
+ *    BEncode.decode(torrent, as: {'info.files' => TorrentFile})
+ *    BEncode.decode(config, freeze: true).frozen? => true
+ */
+
+static VALUE decode(int argc, VALUE* argv, VALUE self){
+  VALUE encoded, hash;
+  decode_opts opts;
+
+  rb_scan_args(argc, argv, "1:", &encoded, &hash);
+  decode_opts_parse(&opts, hash);
+  return decode_string(encoded, &opts);
+}
+
+/*
+ * Document-method: BEncode.decode_prefix
+ * call-seq:
+ *    BEncode.decode_prefix(string, offset = 0, options = {})  -> [value, end_offset]
+ *
+ * Decodes single value starting at byte _offset_ of _string_
+ * and returns it together with offset of the first byte after
+ * it. Anything following the value is left alone, so messages
+ * carrying raw payload after bencoded header (like BEP 9 data
+ * messages) don't need to be split first.
+ * Negative _offset_ counts from the end of _string_.
+ * Returns [nil, offset] if there's nothing left at _offset_.
+ * _options_ are the same as for BEncode.decode.
+ *
+ * Examples:
+ *
+ *   msg = 'd8:msg_typei1e5:piecei0ee' + piece
+ *   header, pos = BEncode.decode_prefix(msg) # => [{"msg_type"=>1, "piece"=>0}, 25]
+ *   piece = msg.byteslice(pos..-1)
+ *
+ *   BEncode.decode_prefix('i1ei2e', 3) # => [2, 6]
+ */
+
+static VALUE decode_prefix(int argc, VALUE* argv, VALUE self){
+  VALUE encoded, offset, hash, val;
+  scan_stack stack;
+  decode_opts opts;
+  decode_ctx ctx;
+  scan_error err;
+  btape tape;
+  long pos = 0, len, end;
+
+  rb_scan_args(argc, argv, "11:", &encoded, &offset, &hash);
+  if(!rb_obj_is_kind_of(encoded, rb_cString))
+    rb_raise(rb_eTypeError, "String expected");
+  decode_opts_parse(&opts, hash);
+
+  len = RSTRING_LEN(encoded);
+  if(!NIL_P(offset))
+    pos = NUM2LONG(offset);
+  if(pos < 0)
+    pos += len;
+  if(pos < 0 || pos > len)
+    rb_raise(rb_eIndexError, "offset %ld outside of string", NIL_P(offset) ? 0 : NUM2LONG(offset));
+  if(pos == len)
+    return rb_assoc_new(Qnil, LONG2NUM(pos));
+
+  scan_stack_init(&stack, opts.strict);
+  tape_init(&tape);
+  end = scan_run(&stack, RSTRING_PTR(encoded), len, pos, opts.depth, NULL, &tape, &err);
+  scan_stack_free(&stack);
+
+  if(end == -1){
+    tape_free(&tape);
+    raise_decode_error(&err);
+  }
+
+  ctx.src = encoded;
+  ctx.tape = &tape;
+  ctx.opts = &opts;
+  ctx.share = opts.share;
+  if(tape.ptr == tape.buf)
+    val = tape_decode((VALUE)&ctx);
+  else
+    val = rb_ensure(tape_decode, (VALUE)&ctx, decode_cleanup, (VALUE)&ctx);
+
+  return rb_assoc_new(val, LONG2NUM(end));
+}
+
+static long batch_next(batch_ctx* batch){
+  long ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&batch->lock);
+#endif
+  ret = batch->next < batch->size ? batch->next++ : -1;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&batch->lock);
+#endif
+  return ret;
+}
+
+/*
+ * Builds tape of _job_ in worker's own _tape_ and keeps copy of its
+ * tokens, so only one full tape per thread exists at a time.
+ * Returns false if the job was interrupted.
+ */
+
+static int batch_job_build(batch_ctx* batch, tape_job* job, btape* tape){
+  tape->size = 0;
+  tape->depth = 0;
+  tape->interrupt = &batch->interrupted;
+  job->end = tape_build(tape, job->str, job->len, job->depth, job->strict, &job->err);
+
+  if(job->end != -1){
+    job->tokens = malloc(tape->size * sizeof(btoken));
+    if(job->tokens){
+      memcpy(job->tokens, tape->ptr, tape->size * sizeof(btoken));
+      job->count = tape->size;
+    }else{
+      job->end = scan_fail(&job->err, DECODE_E_NOMEM, job->str, job->len, 0);
+    }
+  }
+
+  if(tape->capa > DECODER_TAPE_KEEP)
+    tape_free(tape);
+  return job->end != -1 || job->err.code != DECODE_E_INTERRUPT;
+}
+
+/*
+ * Builds tapes for jobs of current batch which are still pending
+ * (not started yet or dropped after interrupt).
+ */
+
+static void* batch_worker(void* ptr){
+  batch_ctx* batch = ptr;
+  btape* tape;
+  long i;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&batch->lock);
+#endif
+  tape = &batch->tapes[batch->workers++];
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&batch->lock);
+#endif
+
+  while(!batch->interrupted && (i = batch_next(batch)) != -1){
+    tape_job* job = &batch->jobs[i];
+
+    if(job->end == -1 && job->err.code == DECODE_E_INTERRUPT)
+      batch_job_build(batch, job, tape);
+  }
+
+  return NULL;
+}
+
+/*
+ * Runs batch_worker in up to _threads_ native threads including the
+ * calling one. Helper threads have all signals blocked, so signals
+ * keep going to Ruby threads. If threads can't be created calling
+ * thread does the work alone.
+ */
+
+static void* batch_run(void* ptr){
+  batch_ctx* batch = ptr;
+#ifdef HAVE_PTHREAD_H
+  pthread_t tids[BATCH_THREADS];
+  sigset_t all, old;
+  int i, n = 0;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for(i = 1; i < batch->threads && i < batch->size; ++i, ++n)
+    if(pthread_create(&tids[n], NULL, batch_worker, batch))
+      break;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  batch_worker(batch);
+  for(i = 0; i < n; ++i)
+    pthread_join(tids[i], NULL);
+#else
+  batch_worker(batch);
+#endif
+  return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void batch_ubf(void* ptr){
+  ((batch_ctx*)ptr)->interrupted = 1;
+}
+#endif
+
+/*
+ * Workers read sources by raw pointers without GVL, while Array marks
+ * its elements as movable, so GC.compact from another thread could move
+ * an embedded copy under them. Batch holds hidden object marking
+ * sources with rb_gc_mark which pins them until batch_cleanup.
+ */
+
+static void batch_pin_mark(void* ptr){
+  batch_ctx* batch = ptr;
+  long i;
+
+  for(i = 0; i < RARRAY_LEN(batch->srcs); ++i)
+    rb_gc_mark(RARRAY_AREF(batch->srcs, i));
+}
+
+static const rb_data_type_t batch_pin_type = {
+  "BEncode::batch",
+  {batch_pin_mark, 0, 0,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Decodes srcs in chunks of BATCH_SIZE items per thread: tapes of
+ * the whole chunk are built in parallel without GVL, then
+ * materialized in order. Every thread builds in its own tape,
+ * jobs keep just their tokens.
+ */
+
+static VALUE batch_decode(VALUE ptr){
+  batch_ctx* batch = (batch_ctx*)ptr;
+  long start, i;
+
+  for(start = 0; start < batch->count; start += batch->chunk){
+    batch->size = batch->count - start < batch->chunk ? batch->count - start : batch->chunk;
+    for(i = 0; i < batch->size; ++i){
+      VALUE src = RARRAY_AREF(batch->srcs, start + i);
+      tape_job* job = &batch->jobs[i];
+
+      job->tape = NULL;
+      job->tokens = NULL;
+      job->count = 0;
+      job->str = RSTRING_PTR(src);
+      job->len = RSTRING_LEN(src);
+      job->depth = batch->depth;
+      job->strict = batch->opts.strict;
+      job->end = job->len ? -1 : 0;
+      job->err.code = job->len ? DECODE_E_INTERRUPT : DECODE_OK;
+    }
+
+    for(;;){
+      int pending = 0;
+
+      batch->next = 0;
+      batch->workers = 0;
+      batch->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+      rb_thread_call_without_gvl(batch_run, batch, batch_ubf, batch);
+#else
+      batch_run(batch);
+#endif
+
+      for(i = 0; i < batch->size; ++i){
+        tape_job* job = &batch->jobs[i];
+
+        if(job->end == -1 && job->err.code == DECODE_E_INTERRUPT)
+          pending = 1;
+      }
+
+      if(!pending)
+        break;
+      rb_thread_check_ints();
+    }
+
+    for(i = 0; i < batch->size; ++i){
+      tape_job* job = &batch->jobs[i];
+      VALUE val = Qnil;
+
+      if(job->end == -1){
+        val = decode_error_new(&job->err);
+      }else if(job->len){
+        decode_ctx ctx;
+        btape tape;
+
+        tape.ptr = job->tokens;
+        tape.size = job->count;
+        ctx.src = RARRAY_AREF(batch->srcs, start + i);
+        ctx.tape = &tape;
+        ctx.opts = &batch->opts;
+        ctx.share = batch->opts.share;
+        val = tape_decode((VALUE)&ctx);
+      }
+
+      free(job->tokens);
+      job->tokens = NULL;
+      rb_ary_push(batch->ret, val);
+    }
+  }
+
+  return batch->ret;
+}
+
+static VALUE batch_cleanup(VALUE ptr){
+  batch_ctx* batch = (batch_ctx*)ptr;
+  long i;
+
+  DATA_PTR(batch->pin) = NULL;
+  for(i = 0; i < batch->size; ++i)
+    free(batch->jobs[i].tokens);
+  for(i = 0; i < batch->threads; ++i)
+    tape_free(&batch->tapes[i]);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&batch->lock);
+#endif
+  xfree(batch->jobs);
+  xfree(batch->tapes);
+  return Qnil;
+}
+
+/*
+ * Document-method: BEncode.decode_many
+ * call-seq:
+ *     BEncode.decode_many(strings, options = {})
+ *
+ * Decodes every string of _strings_ array and returns array
+ * of results in the same order. Inputs are validated in parallel
+ * by native threads without holding GVL, so other Ruby threads
+ * keep running as well. Malformed input doesn't abort the batch:
+ * its result is BEncode::DecodeError instance describing
+ * the problem.
+ *
+ * Options:
+ *
+ * [:threads] number of threads to use, defaults to number
+ *            of online CPUs.
+ *
+ * Other options are the same as for BEncode.decode.
+ *
+ * Examples:
+ *
+ *    BEncode.decode_many(['i1e', 'le', 'x']) => [1, [], #<BEncode::DecodeError: Unknown element type at 0: x!>]
+ *    BEncode.decode_many(blobs, threads: 8)
+ */
+
+static VALUE decode_many(int argc, VALUE* argv, VALUE self){
+  VALUE list, hash, ret, threads = Qundef;
+  decode_opts opts;
+  batch_ctx batch;
+  long i, n;
+
+  rb_scan_args(argc, argv, "1:", &list, &hash);
+  Check_Type(list, T_ARRAY);
+  if(!NIL_P(hash)){
+    hash = rb_hash_dup(hash);
+    rb_get_kwargs(hash, &threadsId, 0, -2, &threads);
+  }
+  decode_opts_parse(&opts, hash);
+
+#ifdef _SC_NPROCESSORS_ONLN
+  n = threads == Qundef || NIL_P(threads) ? sysconf(_SC_NPROCESSORS_ONLN) : NUM2LONG(threads);
+#else
+  n = threads == Qundef || NIL_P(threads) ? 1 : NUM2LONG(threads);
+#endif
+  if(threads != Qundef && !NIL_P(threads) && n < 1)
+    rb_raise(rb_eArgError, "Number of threads must be greater than 0");
+
+  batch.list = list;
+  batch.count = RARRAY_LEN(list);
+  batch.srcs = rb_ary_new_capa(batch.count);
+  for(i = 0; i < batch.count; ++i){
+    VALUE item = RARRAY_AREF(list, i);
+
+    if(!rb_obj_is_kind_of(item, rb_cString))
+      rb_raise(rb_eTypeError, "String expected");
+    rb_ary_push(batch.srcs, rb_str_new_frozen(item));
+  }
+
+  batch.ret = rb_ary_new_capa(batch.count);
+  batch.threads = n < 1 ? 1 : n > BATCH_THREADS ? BATCH_THREADS : (int)n;
+  batch.depth = opts.depth;
+  batch.opts = opts;
+  batch.size = 0;
+  batch.chunk = batch.threads * BATCH_SIZE;
+  if(batch.chunk > batch.count)
+    batch.chunk = batch.count ? batch.count : 1;
+  if(batch.threads > batch.chunk)
+    batch.threads = (int)batch.chunk;
+  batch.jobs = ALLOC_N(tape_job, batch.chunk);
+  batch.tapes = ALLOC_N(btape, batch.threads);
+  for(i = 0; i < batch.chunk; ++i)
+    batch.jobs[i].tokens = NULL;
+  for(i = 0; i < batch.threads; ++i)
+    tape_init(&batch.tapes[i]);
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&batch.lock, NULL);
+#endif
+
+  batch.pin = TypedData_Wrap_Struct(0, &batch_pin_type, &batch);
+  ret = rb_ensure(batch_decode, (VALUE)&batch, batch_cleanup, (VALUE)&batch);
+  RB_GC_GUARD(batch.pin);
+  return ret;
+}
+
+#ifdef HAVE_MMAP
+static void mapping_free(void* ptr){
+  bmapping* map = ptr;
+
+  if(map->ptr)
+    munmap(map->ptr, map->len);
+  xfree(map);
+}
+
+static size_t mapping_memsize(const void* ptr){
+  return sizeof(bmapping);
+}
+
+static const rb_data_type_t mapping_type = {
+  "BEncode::Mapping",
+  {0, mapping_free, mapping_memsize,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | TYPED_SHAREABLE
+};
+
+/*
+ * Maps content of _fp_ starting at its current position into memory.
+ * Returns frozen string pointing into the mapping which is kept alive
+ * by a hidden owner object, so shared substrings and documents stay
+ * valid after the file is closed. Owner sits in internal ivar of the
+ * static root String, returned String is its shared substring without
+ * ivars, so Marshal and dup never see the owner. Pages are read on
+ * access, so truncating the file under live results raises SIGBUS,
+ * callers document that the file must not shrink.
+ * Returns nil if the file can't or shouldn't be mapped.
+ */
+
+static VALUE file_map(VALUE fp){
+  struct stat st;
+  bmapping* map;
+  VALUE owner, root, ret;
+  off_t pos;
+  void* ptr;
+  int fd;
+
+  if(!RTEST(rb_funcall(fp, binmodeId, 0)))
+    return Qnil;
+
+  fd = NUM2INT(rb_funcall(fp, filenoId, 0));
+  if(fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < MMAP_THRESHOLD)
+    return Qnil;
+
+  pos = NUM2OFFT(rb_funcall(fp, posId, 0));
+  if(pos >= st.st_size)
+    return Qnil;
+
+  owner = TypedData_Make_Struct(0, bmapping, &mapping_type, map);
+  ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(ptr == MAP_FAILED)
+    return Qnil;
+
+#ifdef HAVE_MADVISE
+  madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+  map->ptr = ptr;
+  map->len = st.st_size;
+  rb_obj_freeze(owner);
+
+  root = rb_str_new_static((char*)ptr + pos, st.st_size - pos);
+  rb_ivar_set(root, mappingId, owner);
+  rb_obj_freeze(root);
+  ret = rb_obj_freeze(rb_str_subseq(root, 0, RSTRING_LEN(root)));
+
+  rb_funcall(fp, seekId, 2, INT2FIX(0), INT2FIX(SEEK_END));
+  return ret;
+}
+#endif
+
+static VALUE file_read(VALUE fp){
+#ifdef HAVE_MMAP
+  VALUE ret = file_map(fp);
+
+  if(!NIL_P(ret))
+    return ret;
+#endif
+
+  return rb_funcall(fp, readId, 0);
+}
+
+static VALUE file_call_run(VALUE ptr){
+  file_call* call = (file_call*)ptr;
+  return call->fn(call->fp, call->data);
+}
+
+static VALUE file_call_close(VALUE ptr){
+  return rb_io_close(((file_call*)ptr)->fp);
+}
+
+static VALUE file_apply(VALUE path, VALUE (*fn)(VALUE, const void*), const void* data){
+  file_call call;
+
+  if(rb_obj_is_kind_of(path, rb_cIO))
+    return fn(path, data);
+
+  call.fn = fn;
+  call.data = data;
+  call.fp = rb_file_open_str(path, "rb");
+  return rb_ensure(file_call_run, (VALUE)&call, file_call_close, (VALUE)&call);
+}
+
+static VALUE _decode_file(VALUE fp, const void* opts){
+  return decode_string(file_read(fp), opts);
+}
+
+/*
+ * Document-method: BEncode.decode_file
+ * call-seq:
+ *    BEncode.decode_file(file, options = {})
+ *
+ * Loads content of _file_ and decodes it.
+ * _file_ may be either IO instance or
+ * String path to file.
+ * Regular files of 64KB and more opened in binary mode
+ * are memory mapped and parsed in place instead of being
+ * read into intermediate string. File must not be truncated
+ * while it's being decoded, nor while Strings decoded with
+ * share: true are alive.
+ * _options_ are the same as for BEncode.decode.
+ *
+ * Examples:
+ *
+ *   BEncode.decode_file('/path/to/file.torrent')
+ *
+ *   open('/path/to/file.torrent', 'rb') do |f|
+ *     BEncode.decode_file(f)
+ *   end
+ */
+
+static VALUE decode_file(int argc, VALUE* argv, VALUE self){
+  VALUE path, hash;
+  decode_opts opts;
+
+  rb_scan_args(argc, argv, "1:", &path, &hash);
+  decode_opts_parse(&opts, hash);
+  return file_apply(path, _decode_file, &opts);
+}
+
+/*
+ * Appends next chunk of _ctx->io_ to the unparsed rest of buffer.
+ * Chunk is at least as big as the rest, so record spanning many
+ * chunks is rescanned only logarithmic number of times.
+ * Returns 0 on EOF.
+ */
+
+static int stream_fill(stream_ctx* ctx){
+  long rest = RSTRING_LEN(ctx->src) - ctx->pos;
+  VALUE chunk = rb_funcall(ctx->io, readId, 1, LONG2NUM(rest > STREAM_CHUNK ? rest : STREAM_CHUNK));
+  VALUE buf;
+
+  if(NIL_P(chunk))
+    return 0;
+
+  StringValue(chunk);
+  if(!RSTRING_LEN(chunk))
+    return 0;
+
+  buf = rb_str_buf_new(rest + RSTRING_LEN(chunk));
+  rb_str_buf_cat(buf, RSTRING_PTR(ctx->src) + ctx->pos, rest);
+  rb_str_buf_cat(buf, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+
+  ctx->offset += ctx->pos;
+  ctx->src = buf;
+  ctx->pos = 0;
+  return 1;
+}
+
+static VALUE stream_run(VALUE ptr){
+  stream_ctx* ctx = (stream_ctx*)ptr;
+  decode_ctx dctx;
+  scan_error err;
+  VALUE val;
+  long end;
+
+  dctx.tape = &ctx->tape;
+  dctx.opts = ctx->opts;
+  dctx.share = ctx->share;
+
+  for(;;){
+    if(ctx->pos == RSTRING_LEN(ctx->src)){
+      if(NIL_P(ctx->io) || !stream_fill(ctx))
+        break;
+      continue;
+    }
+
+    ctx->stack.size = 0;
+    ctx->tape.size = 0;
+    ctx->tape.depth = 0;
+    end = scan_run(&ctx->stack, RSTRING_PTR(ctx->src), RSTRING_LEN(ctx->src), ctx->pos, ctx->opts->depth, NULL, &ctx->tape, &err);
+
+    if(end == -1){
+      if(!NIL_P(ctx->io) && (err.code == DECODE_E_EOF || err.code == DECODE_E_STR_END || err.code == DECODE_E_INT_END) && stream_fill(ctx))
+        continue;
+      err.pos += ctx->offset;
+      raise_decode_error(&err);
+    }
+
+    dctx.src = ctx->src;
+    val = tape_decode((VALUE)&dctx);
+    ctx->pos = end;
+
+    if(NIL_P(ctx->ret))
+      rb_yield(val);
+    else
+      rb_ary_push(ctx->ret, val);
+  }
+
+  return ctx->ret;
+}
+
+static VALUE stream_cleanup(VALUE ptr){
+  stream_ctx* ctx = (stream_ctx*)ptr;
+
+  scan_stack_free(&ctx->stack);
+  tape_free(&ctx->tape);
+  return Qnil;
+}
+
+/*
+ * Decodes every value of _src_ one after another, either pushing
+ * them to _ret_ or yielding if _ret_ is nil. Scanner and tape are
+ * shared by all records. IO is read in chunks unless it can be
+ * memory mapped.
+ */
+
+static VALUE stream_decode(VALUE src, const decode_opts* opts, VALUE ret){
+  stream_ctx ctx;
+
+  ctx.io = Qnil;
+  ctx.ret = ret;
+  ctx.pos = 0;
+  ctx.offset = 0;
+  ctx.opts = opts;
+
+  ctx.share = opts && opts->share;
+  if(rb_obj_is_kind_of(src, rb_cString)){
+    ctx.src = rb_str_new_frozen(src);
+  }else if(rb_respond_to(src, readId)){
+    ctx.src = Qnil;
+#ifdef HAVE_MMAP
+    if(rb_obj_is_kind_of(src, rb_cIO))
+      ctx.src = file_map(src);
+#endif
+    if(NIL_P(ctx.src)){
+      ctx.src = rb_str_new(NULL, 0);
+      ctx.io = src;
+    }
+  }else{
+    rb_raise(rb_eTypeError, "String or IO expected");
+  }
+
+  scan_stack_init(&ctx.stack, opts && opts->strict);
+  tape_init(&ctx.tape);
+  return rb_ensure(stream_run, (VALUE)&ctx, stream_cleanup, (VALUE)&ctx);
+}
+
+/*
+ * Document-method: BEncode.each
+ * call-seq:
+ *    BEncode.each(src, options = {}) { |value| ... }
+ *    BEncode.each(src, options = {})                   -> enumerator
+ *
+ * Decodes concatenated bencoded values from _src_ and
+ * yields them one by one. _src_ is either String or
+ * IO-like object responding to read, IO is consumed
+ * in chunks so whole stream is never kept in memory.
+ * Raises BEncode::DecodeError if stream ends in the
+ * middle of value, values yielded before stay valid.
+ * _options_ are the same as for BEncode.decode.
+ * Returns enumerator if no block given.
+ *
+ * Examples:
+ *
+ *   BEncode.each('i1e3:abcle') { |v| p v } # prints 1, "abc", []
+ *
+ *   open('/path/to/audit.log', 'rb') do |f|
+ *     BEncode.each(f, symbolize_keys: true) { |rec| ... }
+ *   end
+ */
+
+static VALUE each(int argc, VALUE* argv, VALUE self){
+  VALUE src, hash;
+  decode_opts opts;
+
+  RETURN_ENUMERATOR_KW(self, argc, argv, rb_keyword_given_p());
+  rb_scan_args(argc, argv, "1:", &src, &hash);
+  decode_opts_parse(&opts, hash);
+  stream_decode(src, &opts, Qnil);
+  return src;
+}
+
+/*
+ * Document-method: BEncode.decode_all
+ * call-seq:
+ *    BEncode.decode_all(src, options = {})  -> array
+ *
+ * Decodes all concatenated values from _src_ and returns
+ * them as Array. See BEncode.each.
+ *
+ * Examples:
+ *
+ *   BEncode.decode_all('i1e3:abcle') # => [1, "abc", []]
+ *   BEncode.decode_all('')           # => []
+ */
+
+static VALUE decode_all(int argc, VALUE* argv, VALUE self){
+  VALUE src, hash;
+  decode_opts opts;
+
+  rb_scan_args(argc, argv, "1:", &src, &hash);
+  decode_opts_parse(&opts, hash);
+  return stream_decode(src, &opts, rb_ary_new());
+}
+
+static void events_dispatch(void* ctx, int type, const char* str, long len){
+  events_handler* handler = ctx;
+  VALUE arg;
+
+  if(!handler->ids[type])
+    return;
+
+  switch(type){
+    case EVENT_INT:{
+      char* p = (char*)str;
+      long rem = len;
+
+      arg = int_value(str, len, parse_num(&p, &rem));
+      break;
+    }
+    case EVENT_KEY:
+      arg = key_new(str, len);
+      break;
+    case EVENT_STRING:
+      arg = rb_str_new(str, len);
+      break;
+    default:
+      rb_funcall(handler->obj, handler->ids[type], 0);
+      return;
+  }
+
+  rb_funcall(handler->obj, handler->ids[type], 1, arg);
+}
+
+static VALUE events_run(VALUE ptr){
+  events_handler* handler = (events_handler*)ptr;
+  const char* str = RSTRING_PTR(handler->src);
+  long len = RSTRING_LEN(handler->src), end;
+  scan_events events;
+  scan_error err;
+
+  events.fn = events_dispatch;
+  events.ctx = handler;
+  end = scan_run(&handler->stack, str, len, 0, max_depth, &events, NULL, &err);
+  if(end == -1)
+    raise_decode_error(&err);
+  if(end != len)
+    rb_raise(DecodeError, "String has garbage on the end (starts at %ld).", end);
+
+  return handler->obj;
+}
+
+static VALUE events_cleanup(VALUE ptr){
+  scan_stack_free(&((events_handler*)ptr)->stack);
+  return Qnil;
+}
+
+/*
+ * Document-method: BEncode.parse_events
+ * call-seq:
+ *    BEncode.parse_events(string, handler)
+ *
+ * Walks _string_ calling methods of _handler_ for every
+ * token instead of building containers:
+ *   on_dict_start
+ *   on_list_start
+ *   on_key(string)
+ *   on_string(string)
+ *   on_int(integer)
+ *   on_end
+ * Methods _handler_ doesn't respond to are skipped.
+ * Events are reported as they're seen, so malformed input
+ * raises BEncode::DecodeError after reporting the valid part.
+ * Returns _handler_.
+ *
+ * Examples:
+ *
+ *   class Summer
+ *     attr_reader :sum
+ *     def initialize; @sum = 0; end
+ *     def on_int(i); @sum += i; end
+ *   end
+ *
+ *   BEncode.parse_events('li1ei2ee', Summer.new).sum => 3
+ */
+
+static VALUE parse_events(VALUE self, VALUE encoded, VALUE obj){
+  static const char* names[] = {"on_dict_start", "on_list_start", "on_key", "on_string", "on_int", "on_end"};
+  events_handler handler;
+  int i;
+
+  if(!rb_obj_is_kind_of(encoded, rb_cString))
+    rb_raise(rb_eTypeError, "String expected");
+
+  handler.obj = obj;
+  handler.src = rb_str_new_frozen(encoded);
+  for(i = 0; i < EVENT_COUNT; ++i){
+    ID id = rb_intern(names[i]);
+    handler.ids[i] = rb_respond_to(obj, id) ? id : 0;
+  }
+
+  if(!RSTRING_LEN(handler.src))
+    return obj;
+
+  scan_stack_init(&handler.stack, 0);
+  rb_ensure(events_run, (VALUE)&handler, events_cleanup, (VALUE)&handler);
+  RB_GC_GUARD(handler.src);
+  return obj;
+}
+
+/*
+ * Validates whole _encoded_ string the way decode does with options
+ * from _hash_, reporting tokens to _events_ if given. Returns -1 with _err_ filled in for
+ * malformed or empty input.
+ */
+
+static long scan_string(VALUE encoded, VALUE hash, const scan_events* events, scan_error* err){
+  const char* str;
+  scan_stack stack;
+  decode_opts opts;
+  long len, end;
+
+  if(!rb_obj_is_kind_of(encoded, rb_cString))
+    rb_raise(rb_eTypeError, "String expected");
+  decode_opts_parse(&opts, hash);
+
+  str = RSTRING_PTR(encoded);
+  len = RSTRING_LEN(encoded);
+  if(!len)
+    return scan_fail(err, DECODE_E_STR_END, str, len, 0);
+
+  scan_stack_init(&stack, opts.strict);
+  end = scan_run(&stack, str, len, 0, opts.depth, events, NULL, err);
+  scan_stack_free(&stack);
+
+  if(end != -1 && end != len)
+    return scan_fail(err, DECODE_E_GARBAGE, str, len, end);
+  return end;
+}
+
+/*
+ * Document-method: BEncode.valid?
+ * call-seq:
+ *    BEncode.valid?(string, options = {})
+ *
+ * Checks whether _string_ holds exactly one value
+ * BEncode.decode would accept (including BEncode.max_depth
+ * limit) without building anything, so no Ruby objects are
+ * allocated. Empty string holds no value and is not valid,
+ * though BEncode.decode returns nil for it. Accepts the same
+ * options as BEncode.decode.
+ *
+ * Examples:
+ *
+ *   BEncode.valid?('li1ee') => true
+ *   BEncode.valid?('li1e') => false
+ *   BEncode.valid?('i01e', strict: true) => false
+ */
+
+static VALUE is_valid(int argc, VALUE* argv, VALUE self){
+  VALUE encoded, hash;
+  scan_error err;
+
+  rb_scan_args(argc, argv, "1:", &encoded, &hash);
+  return scan_string(encoded, hash, NULL, &err) == -1 ? Qfalse : Qtrue;
+}
+
+static void stats_event(void* ptr, int type, const char* str, long len){
+  scan_stats* stats = ptr;
+
+  ++stats->counts[type];
+  switch(type){
+    case EVENT_DICT:
+    case EVENT_LIST:
+      if(++stats->depth > stats->max_depth)
+        stats->max_depth = stats->depth;
+      break;
+    case EVENT_END:
+      --stats->depth;
+      break;
+    case EVENT_KEY:
+    case EVENT_STRING:
+      stats->string_bytes += len;
+      break;
+  }
+}
+
+/*
+ * Document-method: BEncode.scan
+ * call-seq:
+ *    BEncode.scan(string, options = {})
+ *
+ * Validates _string_ like BEncode.valid? and returns summary
+ * of its shape:
+ *   :valid         - whether string is valid
+ *   :dicts         - number of dictionaries
+ *   :lists         - number of lists
+ *   :keys          - number of dictionary keys
+ *   :strings       - number of string values (besides keys)
+ *   :integers      - number of integers
+ *   :max_depth     - deepest containers nesting
+ *   :string_bytes  - total length of keys and strings
+ *   :error_offset  - offset of the first error or nil
+ *   :error         - error message or nil
+ * For invalid input counts cover the part before the error.
+ *
+ * Examples:
+ *
+ *   BEncode.scan('d1:ali1ei2eee')
+ *   # => {:valid=>true, :dicts=>1, :lists=>1, :keys=>1, :strings=>0, :integers=>2,
+ *   #     :max_depth=>2, :string_bytes=>1, :error_offset=>nil, :error=>nil}
+ */
+
+static VALUE scan(int argc, VALUE* argv, VALUE self){
+  VALUE encoded, hash, ret;
+  scan_events events;
+  scan_stats stats;
+  scan_error err;
+  long end;
+  int i;
+
+  rb_scan_args(argc, argv, "1:", &encoded, &hash);
+  MEMZERO(&stats, scan_stats, 1);
+  events.fn = stats_event;
+  events.ctx = &stats;
+  end = scan_string(encoded, hash, &events, &err);
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, scan_stat_keys[SCAN_STAT_VALID], end == -1 ? Qfalse : Qtrue);
+  for(i = EVENT_DICT; i <= EVENT_INT; ++i)
+    rb_hash_aset(ret, scan_stat_keys[SCAN_STAT_DICTS + i], LONG2NUM(stats.counts[i]));
+  rb_hash_aset(ret, scan_stat_keys[SCAN_STAT_MAX_DEPTH], LONG2NUM(stats.max_depth));
+  rb_hash_aset(ret, scan_stat_keys[SCAN_STAT_STRING_BYTES], LONG2NUM(stats.string_bytes));
+  rb_hash_aset(ret, scan_stat_keys[SCAN_STAT_ERROR_OFFSET], end == -1 ? LONG2NUM(err.pos) : Qnil);
+  rb_hash_aset(ret, scan_stat_keys[SCAN_STAT_ERROR], end == -1 ? rb_funcall(decode_error_new(&err), rb_intern("message"), 0) : Qnil);
+  return ret;
+}
+
+/*
+ * Looks for value of the top level "info" key walking only the top
+ * dictionary and skipping values with the scanner. Whole input is
+ * validated on the way. Returns 1 and fills _start_/_end_ if the key
+ * was found, 0 if it wasn't and -1 on malformed input.
+ */
+
+static int info_span_find(const char* str, long len, long* start, long* end, scan_error* err){
+  long pos = 1, depth = max_depth == -1 ? -1 : max_depth - 1;
+  int found = 0;
+
+  if(*str != 'd'){
+    pos = scan_value(str, len, 0, max_depth, err);
+  }else if(!max_depth){
+    scan_fail(err, DECODE_E_DEPTH, str, len, 0);
+    pos = -1;
+  }else{
+    while(pos != -1){
+      char* p = (char*)str + pos;
+      long rem = len - pos, key, klen;
+
+      if(pos < len && str[pos] == 'e'){
+        ++pos;
+        break;
+      }
+      if(pos < len && (str[pos] < '0' || str[pos] > '9')){
+        pos = scan_fail(err, DECODE_E_KEY, str, len, pos);
+        break;
+      }
+
+      klen = parse_num(&p, &rem);
+      key = scan_value(str, len, pos, -1, err);
+      if(key == -1)
+        return -1;
+
+      pos = scan_value(str, len, key, depth, err);
+      if(pos != -1 && klen == 4 && !memcmp(str + key - 4, "info", 4)){
+        *start = key;
+        *end = pos;
+        found = 1;
+      }
+    }
+  }
+
+  if(pos == -1)
+    return -1;
+  if(pos != len){
+    scan_fail(err, DECODE_E_GARBAGE, str, len, pos);
+    return -1;
+  }
+
+  return found;
+}
+
+static int info_span_get(VALUE encoded, long* start, long* end){
+  scan_error err;
+  int ret;
+
+  if(!rb_obj_is_kind_of(encoded, rb_cString))
+    rb_raise(rb_eTypeError, "String expected");
+  if(!RSTRING_LEN(encoded))
+    return 0;
+
+  ret = info_span_find(RSTRING_PTR(encoded), RSTRING_LEN(encoded), start, end, &err);
+  if(ret == -1)
+    raise_decode_error(&err);
+
+  return ret;
+}
+
+/*
+ * Document-method: BEncode.info_span
+ * call-seq:
+ *    BEncode.info_span(string)
+ *
+ * Returns [start, end] byte offsets of the top level "info"
+ * value in _string_ (_end_ is exclusive), or nil if there's no
+ * such key. Nothing is decoded, but the whole _string_ is validated.
+ *
+ * Examples:
+ *
+ *   BEncode.info_span('d4:infod1:ai1eee') => [7, 15]
+ */
+
+static VALUE info_span(VALUE self, VALUE encoded){
+  long start, end;
+
+  if(!info_span_get(encoded, &start, &end))
+    return Qnil;
+
+  return rb_assoc_new(LONG2NUM(start), LONG2NUM(end));
+}
+
+/*
+ * Document-method: BEncode.info_hash
+ * call-seq:
+ *    BEncode.info_hash(string, algorithm = :sha1)
+ *
+ * Returns binary digest of raw bytes of the top level "info" value
+ * (BitTorrent info-hash) or nil if there's no such key. _algorithm_
+ * is either :sha1 or :sha256. Bytes are hashed in place, so the
+ * digest matches the source even if it wasn't canonically encoded.
+ * Use BEncode.info_span to get the hashed byte range.
+ *
+ * Examples:
+ *
+ *   BEncode.info_hash(File.binread('file.torrent')).unpack1('H*')
+ *   BEncode.info_hash(File.binread('file.torrent'), :sha256)
+ */
+
+static VALUE info_hash(int argc, VALUE* argv, VALUE self){
+  VALUE encoded, algo;
+  long start, end;
+  int sha256;
+
+  rb_scan_args(argc, argv, "11", &encoded, &algo);
+  if(NIL_P(algo) || algo == ID2SYM(sha1Id))
+    sha256 = 0;
+  else if(algo == ID2SYM(sha256Id))
+    sha256 = 1;
+  else
+    rb_raise(rb_eArgError, "Unknown hash algorithm, :sha1 or :sha256 expected");
+
+  if(!info_span_get(encoded, &start, &end))
+    return Qnil;
+
+#if defined(HAVE_OPENSSL_SHA_H) && defined(HAVE_SHA256)
+  {
+    const unsigned char* data = (const unsigned char*)RSTRING_PTR(encoded) + start;
+    unsigned char md[SHA256_DIGEST_LENGTH];
+
+    if(sha256){
+      SHA256(data, end - start, md);
+      return rb_str_new((char*)md, SHA256_DIGEST_LENGTH);
+    }
+
+    SHA1(data, end - start, md);
+    return rb_str_new((char*)md, SHA_DIGEST_LENGTH);
+  }
+#else
+  rb_require(sha256 ? "digest/sha2" : "digest/sha1");
+  return rb_funcall(rb_path2class(sha256 ? "Digest::SHA256" : "Digest::SHA1"), rb_intern("digest"), 1,
+                    rb_str_subseq(rb_str_new_frozen(encoded), start, end - start));
+#endif
+}
+
+#define GET_DOC(self, doc) TypedData_Get_Struct(self, bdocument, &doc_type, doc)
+#define DOC_IS_DICT(doc) (RSTRING_PTR((doc)->src)[(doc)->start] == 'd')
+#define DOC_WIDTH(doc) (DOC_IS_DICT(doc) ? 4 : 2)
+#define DOC_TABLE(doc) if((doc)->count == -1) doc_build_table(doc)
+#define DOC_SIZE(doc) ((doc)->order ? (doc)->unique : (doc)->count)
+#define DOC_ENTRY(doc, i) ((doc)->order ? (doc)->order[i] : (i))
+
+static void doc_mark(void* ptr){
+  rb_gc_mark(((bdocument*)ptr)->src);
+  rb_gc_mark(((bdocument*)ptr)->owner);
+}
+
+static void doc_free(void* ptr){
+  bdocument* doc = ptr;
+
+  if(doc->table && NIL_P(doc->owner))
+    xfree(doc->table);
+  if(doc->order)
+    xfree(doc->order);
+  xfree(doc);
+}
+
+static size_t doc_memsize(const void* ptr){
+  const bdocument* doc = ptr;
+  size_t size = sizeof(*doc) + doc->unique * sizeof(long);
+
+  if(doc->count > 0 && NIL_P(doc->owner))
+    size += doc->count * DOC_WIDTH(doc) * sizeof(long);
+  return size;
+}
+
+static const rb_data_type_t doc_type = {
+  "BEncode::Document",
+  {doc_mark, doc_free, doc_memsize,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE doc_new(VALUE src, long start, long end){
+  bdocument* doc;
+  VALUE ret = TypedData_Make_Struct(Document, bdocument, &doc_type, doc);
+
+  doc->src = src;
+  doc->start = start;
+  doc->end = end;
+  doc->count = -1;
+  doc->table = NULL;
+  doc->order = NULL;
+  doc->unique = 0;
+  doc->sorted = 1;
+  doc->checked = 1;
+  doc->owner = Qnil;
+  return ret;
+}
+
+/*
+ * Materializes value occupying bytes from _pos_ up to _end_.
+ * Scalars become Ruby objects, containers become nested documents
+ * sharing the same source string. Children of a document opened
+ * from index weren't scanned yet, so containers are validated
+ * before anything inside them is trusted.
+ */
+
+static VALUE doc_value_at(bdocument* doc, long pos, long end){
+  char* str = RSTRING_PTR(doc->src) + pos;
+  long len = end - pos;
+
+  switch(*str){
+    case 'l':
+    case 'd':
+      if(!doc->checked){
+        scan_error err;
+        long ret = scan_value(RSTRING_PTR(doc->src), end, pos, max_depth > 0 ? max_depth - 1 : max_depth, &err);
+
+        if(ret == -1)
+          raise_decode_error(&err);
+        if(ret != end)
+          rb_raise(DecodeError, "String has garbage on the end (starts at %ld).", ret);
+      }
+      return doc_new(doc->src, pos, end);
+    case 'i':{
+      char* start = ++str;
+      long num;
+
+      --len;
+      num = parse_num(&str, &len);
+      return int_value(start, str - start, num);
+    }
+    default:{
+      long slen = parse_num(&str, &len);
+      return rb_str_new(str + 1, slen);
+    }
+  }
+}
+
+/*
+ * Builds offset table of container children on first access.
+ * List entries are value start/end pairs, dictionary entries are
+ * key data offset, key length, value start and value end.
+ * Source was validated by BEncode.view so scanning can't fail here.
+ */
+
+static void doc_build_table(bdocument* doc){
+  const char* str = RSTRING_PTR(doc->src);
+  int width = DOC_WIDTH(doc);
+  long pos = doc->start + 1, count = 0, capa = 8;
+  long* table = ALLOC_N(long, capa * width);
+  long* entry;
+  scan_error err;
+
+  while(str[pos] != 'e'){
+    if(count == capa){
+      capa *= 2;
+      REALLOC_N(table, long, capa * width);
+    }
+
+    entry = table + count * width;
+    if(width == 4){
+      char* p = (char*)str + pos;
+      long rem = doc->end - pos;
+
+      entry[1] = parse_num(&p, &rem);
+      entry[0] = p + 1 - str;
+      pos = entry[0] + entry[1];
+
+      if(count){
+        long plen = entry[-3];
+        int cmp = memcmp(str + entry[-4], str + entry[0], plen < entry[1] ? plen : entry[1]);
+
+        if(cmp > 0 || (cmp == 0 && plen >= entry[1]))
+          doc->sorted = 0;
+      }
+    }
+
+    entry[width - 2] = pos;
+    entry[width - 1] = pos = scan_value(str, doc->end, pos, -1, &err);
+    ++count;
+  }
+
+  doc->table = table;
+  doc->count = count;
+  if(width == 4 && !doc->sorted)
+    doc_dedup(doc);
+}
+
+/*
+ * Unsorted dictionary may repeat keys. BEncode.decode keeps position
+ * of the first occurrence and value of the last one, so when there
+ * are repeats _order_ lists entries to visit in that order, each
+ * being the last occurrence of its key.
+ */
+
+static void doc_dedup(bdocument* doc){
+  const char* str = RSTRING_PTR(doc->src);
+  VALUE seen = rb_hash_new(), last;
+  long i;
+
+  for(i = 0; i < doc->count; ++i)
+    rb_hash_aset(seen, key_new(str + doc->table[i * 4], doc->table[i * 4 + 1]), LONG2FIX(i));
+
+  if(RHASH_SIZE(seen) == (size_t)doc->count)
+    return;
+
+  last = rb_funcall(seen, rb_intern("values"), 0);
+  doc->order = ALLOC_N(long, RARRAY_LEN(last));
+  for(i = 0; i < RARRAY_LEN(last); ++i)
+    doc->order[i] = FIX2LONG(RARRAY_AREF(last, i));
+  doc->unique = RARRAY_LEN(last);
+}
+
+static long doc_find_key(bdocument* doc, const char* key, long klen){
+  const char* str = RSTRING_PTR(doc->src);
+  long lo = 0, hi = doc->count;
+
+  if(!doc->sorted){
+    while(hi-- > lo){
+      long* entry = doc->table + hi * 4;
+      if(entry[1] == klen && !memcmp(str + entry[0], key, klen))
+        return hi;
+    }
+    return -1;
+  }
+
+  while(lo < hi){
+    long mid = (lo + hi) / 2, *entry = doc->table + mid * 4;
+    int cmp = memcmp(str + entry[0], key, entry[1] < klen ? entry[1] : klen);
+
+    if(!cmp)
+      cmp = entry[1] < klen ? -1 : entry[1] > klen;
+    if(!cmp)
+      return mid;
+    if(cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return -1;
+}
+
+/*
+ * Document-method: BEncode.view
+ * call-seq:
+ *    BEncode.view(string)
+ *
+ * Validates _string_ and returns BEncode::Document giving
+ * lazy access to its content. Nothing besides scalars that
+ * are actually accessed gets materialized. If _string_ holds
+ * scalar value it is returned as is.
+ *
+ * Examples:
+ *
+ *   doc = BEncode.view(File.binread('file.torrent'))
+ *   doc['info']['name'] => 'file.iso'
+ *   doc.dig('info', 'files', 0, 'length') => 1024
+ */
+
+static VALUE view(VALUE self, VALUE encoded){
+  scan_error err;
+  long len, end;
+  VALUE src;
+
+  if(!rb_obj_is_kind_of(encoded, rb_cString))
+    rb_raise(rb_eTypeError, "String expected");
+
+  len = RSTRING_LEN(encoded);
+  if(!len)
+    return Qnil;
+
+  src = rb_str_new_frozen(encoded);
+  end = scan_value(RSTRING_PTR(src), len, 0, max_depth, &err);
+  if(end == -1)
+    raise_decode_error(&err);
+  if(end != len)
+    rb_raise(DecodeError, "String has garbage on the end (starts at %ld).", end);
+
+  switch(RSTRING_PTR(src)[0]){
+    case 'l':
+    case 'd':
+      return doc_new(src, 0, len);
+    default:
+      return decode_string(src, NULL);
+  }
+}
+
+/*
+ * Fills identity of file _fp_ is reading: size, modification time
+ * and current position. Index is valid only for the same identity.
+ */
+
+static void index_stamp(VALUE fp, bindex* idx){
+  VALUE stat = rb_funcall(fp, rb_intern("stat"), 0);
+  VALUE mtime = rb_funcall(stat, rb_intern("mtime"), 0);
+
+  memset(idx, 0, sizeof(*idx));
+  memcpy(idx->magic, INDEX_MAGIC, sizeof(idx->magic));
+  idx->word = sizeof(long);
+  idx->size = NUM2LL(rb_funcall(stat, rb_intern("size"), 0));
+  idx->mtime = NUM2LL(rb_funcall(mtime, rb_intern("tv_sec"), 0));
+  idx->mtime_nsec = NUM2LL(rb_funcall(mtime, rb_intern("tv_nsec"), 0));
+  idx->base = NUM2LL(rb_funcall(fp, posId, 0));
+}
+
+/*
+ * FNV-1a hash of the first and the last page of _len_ bytes at _str_.
+ * Catches content rewritten in place without changing size or
+ * modification time while reading only two pages of the file.
+ */
+
+static uint64_t index_check(const char* str, long len){
+  uint64_t hash = 14695981039346656037ULL;
+  long head = len < INDEX_CHECK_PAGE ? len : INDEX_CHECK_PAGE;
+  long tail = len - head < INDEX_CHECK_PAGE ? len - head : INDEX_CHECK_PAGE;
+  long i;
+
+  for(i = 0; i < head; ++i)
+    hash = (hash ^ (unsigned char)str[i]) * 1099511628211ULL;
+  for(i = len - tail; i < len; ++i)
+    hash = (hash ^ (unsigned char)str[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static VALUE _build_index(VALUE fp, const void* data){
+  VALUE path = *(const VALUE*)data, doc, out, tmp;
+  bdocument* d;
+  bindex idx;
+  long size;
+
+  index_stamp(fp, &idx);
+  doc = view(BEncode, file_read(fp));
+  if(!rb_typeddata_is_kind_of(doc, &doc_type))
+    rb_raise(rb_eArgError, "Only lists and dictionaries can be indexed");
+
+  GET_DOC(doc, d);
+  DOC_TABLE(d);
+  idx.check = index_check(RSTRING_PTR(d->src), RSTRING_LEN(d->src));
+  idx.start = d->start;
+  idx.end = d->end;
+  idx.count = d->count;
+  idx.sorted = d->sorted;
+
+  size = d->count * DOC_WIDTH(d) * sizeof(long);
+  out = rb_str_buf_new(sizeof(idx) + size);
+  rb_str_buf_cat(out, (const char*)&idx, sizeof(idx));
+  rb_str_buf_cat(out, (const char*)d->table, size);
+  RB_GC_GUARD(doc);
+
+  tmp = rb_str_plus(path, rb_str_new_cstr(".tmp"));
+  rb_funcall(rb_cFile, rb_intern("binwrite"), 2, tmp, out);
+  rb_funcall(rb_cFile, rb_intern("rename"), 2, tmp, path);
+  return path;
+}
+
+/*
+ * Document-method: BEncode.build_index
+ * call-seq:
+ *    BEncode.build_index(file, index = nil)
+ *
+ * Validates top level list or dictionary in _file_ and
+ * saves offsets of its elements to _index_ file, by default
+ * _file_ path with .bidx appended. BEncode.view_file
+ * given the index opens _file_ without scanning it.
+ * Index records size, modification time and checksum of
+ * the first and the last page of _file_ and is ignored
+ * once they change.
+ * Returns path of the index.
+ *
+ * Examples:
+ *
+ *   BEncode.build_index('scrape.benc') # => "scrape.benc.bidx"
+ *   BEncode.view_file('scrape.benc', index: true)[1_000_000]
+ */
+
+static VALUE build_index(int argc, VALUE* argv, VALUE self){
+  VALUE path, index;
+
+  rb_scan_args(argc, argv, "11", &path, &index);
+  if(NIL_P(index)){
+    if(!RB_TYPE_P(path, T_STRING))
+      rb_raise(rb_eArgError, "Index path is required for IO");
+    index = rb_str_plus(path, rb_str_new_cstr(".bidx"));
+  }
+
+  FilePathValue(index);
+  return file_apply(path, _build_index, &index);
+}
+
+/*
+ * Reads index header and returns table String if it matches
+ * the stamp, nil otherwise. Large tables are memory mapped.
+ */
+
+static VALUE _index_read(VALUE fp, const void* data){
+  index_read_ctx* ctx = (index_read_ctx*)data;
+  const bindex* stamp = ctx->stamp;
+  bindex* idx = &ctx->idx;
+  VALUE head = rb_funcall(fp, readId, 1, INT2FIX(sizeof(*idx)));
+
+  if(NIL_P(head) || RSTRING_LEN(head) != sizeof(*idx))
+    return Qnil;
+
+  memcpy(idx, RSTRING_PTR(head), sizeof(*idx));
+  if(memcmp(idx->magic, stamp->magic, sizeof(idx->magic)) || idx->word != stamp->word ||
+     idx->size != stamp->size || idx->mtime != stamp->mtime ||
+     idx->mtime_nsec != stamp->mtime_nsec || idx->base != stamp->base)
+    return Qnil;
+
+#ifdef HAVE_MMAP
+  {
+    VALUE ret = file_map(fp);
+
+    if(!NIL_P(ret)){
+      ctx->mapped = 1;
+      return ret;
+    }
+  }
+#endif
+  return rb_funcall(fp, readId, 0);
+}
+
+/*
+ * Checks index _idx_ with offset _table_ against _len_ bytes of source
+ * at _str_: header must describe the whole source and its checksum,
+ * entries must follow each other without gaps from container start
+ * to its end, keys must start right after their length prefix,
+ * scalars must be complete and containers must be closed. Containers'
+ * content is left to doc_value_at, so only entry bounds are read.
+ */
+
+static int index_valid(const char* str, long len, const bindex* idx, VALUE table){
+  long pos = 1, end = len - 1, i, width;
+  const long* entry;
+  int sorted = 1;
+  scan_error err;
+
+  if(idx->start != 0 || idx->end != len || len < 2 || idx->count < 0 ||
+     (str[0] != 'l' && str[0] != 'd') || str[end] != 'e')
+    return 0;
+
+  width = str[0] == 'd' ? 4 : 2;
+  if(idx->count > LONG_MAX / (width * (long)sizeof(long)) ||
+     RSTRING_LEN(table) != idx->count * width * (long)sizeof(long) ||
+     idx->check != index_check(str, len))
+    return 0;
+
+  for(i = 0, entry = (const long*)RSTRING_PTR(table); i < idx->count; ++i, entry += width){
+    if(width == 4){
+      char* p = (char*)str + pos;
+      long rem = end - pos, klen;
+
+      if(*p < '0' || *p > '9')
+        return 0;
+      klen = parse_num(&p, &rem);
+      if(!rem || *p != ':' || entry[0] != p + 1 - str || entry[1] != klen || klen < 0 || klen >= end - entry[0])
+        return 0;
+
+      if(i){
+        long plen = entry[-3];
+        int cmp = memcmp(str + entry[-4], str + entry[0], plen < klen ? plen : klen);
+
+        if(cmp > 0 || (cmp == 0 && plen >= klen))
+          sorted = 0;
+      }
+      pos = entry[0] + klen;
+    }
+
+    if(entry[width - 2] != pos || entry[width - 1] <= pos || entry[width - 1] > end)
+      return 0;
+
+    switch(str[pos]){
+      case 'l':
+      case 'd':
+        if(entry[width - 1] - pos < 2 || str[entry[width - 1] - 1] != 'e')
+          return 0;
+        break;
+      default:
+        if(scan_value(str, entry[width - 1], pos, 0, &err) != entry[width - 1])
+          return 0;
+    }
+    pos = entry[width - 1];
+  }
+
+  return pos == end && sorted == idx->sorted;
+}
+
+/*
+ * Returns document for _fp_ with offset table taken from index
+ * at _path_ or nil if index is missing, stale or doesn't match
+ * the file content.
+ */
+
+static VALUE index_load(VALUE fp, VALUE path){
+  index_read_ctx ctx;
+  VALUE table, src, doc;
+  bdocument* d;
+  bindex stamp;
+  long width;
+
+  if(!RTEST(rb_funcall(rb_cFile, rb_intern("file?"), 1, path)))
+    return Qnil;
+
+  index_stamp(fp, &stamp);
+  ctx.stamp = &stamp;
+  ctx.mapped = 0;
+  table = file_apply(path, _index_read, &ctx);
+  if(NIL_P(table))
+    return Qnil;
+
+  src = rb_str_new_frozen(file_read(fp));
+  if(!index_valid(RSTRING_PTR(src), RSTRING_LEN(src), &ctx.idx, table)){
+    rb_funcall(fp, seekId, 2, LL2NUM(stamp.base), INT2FIX(SEEK_SET));
+    return Qnil;
+  }
+
+  width = RSTRING_PTR(src)[0] == 'd' ? 4 : 2;
+  doc = doc_new(src, ctx.idx.start, ctx.idx.end);
+  GET_DOC(doc, d);
+  d->count = ctx.idx.count;
+  d->sorted = ctx.idx.sorted;
+  d->checked = 0;
+
+  if(ctx.mapped){
+    d->table = (long*)RSTRING_PTR(table);
+    d->owner = table;
+  }else{
+    d->table = ALLOC_N(long, d->count * width + 1);
+    memcpy(d->table, RSTRING_PTR(table), RSTRING_LEN(table));
+  }
+  if(width == 4 && !d->sorted)
+    doc_dedup(d);
+
+  return doc;
+}
+
+static VALUE _view_file(VALUE fp, const void* data){
+  VALUE index = *(const VALUE*)data, doc;
+
+  if(!NIL_P(index) && !NIL_P(doc = index_load(fp, index)))
+    return doc;
+
+  return view(BEncode, file_read(fp));
+}
+
+/*
+ * Document-method: BEncode.view_file
+ * call-seq:
+ *    BEncode.view_file(file, index: nil)
+ *
+ * Same as BEncode.view for content of _file_ (IO instance
+ * or path). Large regular files are memory mapped, so
+ * the file content is never copied, only accessed values
+ * are. Documents read the mapping directly, so the file
+ * must not be truncated while any of them or their raw
+ * Strings are alive: accessing bytes past the new end
+ * kills the process with SIGBUS instead of raising.
+ * _index_ is path of index saved by BEncode.build_index
+ * or true for the default one. Valid index replaces
+ * scanning of the whole file and its offset table is
+ * mapped too, so opening only checks bounds of top level
+ * elements instead of scanning all the content. Nested
+ * containers are validated once accessed. Missing,
+ * outdated or inconsistent index is ignored.
+ *
+ * Examples:
+ *
+ *   BEncode.view_file('/path/to/file.torrent').dig('info', 'name')
+ *   BEncode.view_file('scrape.benc', index: true)[1_000_000]
+ */
+
+static VALUE view_file(int argc, VALUE* argv, VALUE self){
+  VALUE path, hash, index = Qnil;
+  ID id = rb_intern("index");
+
+  rb_scan_args(argc, argv, "1:", &path, &hash);
+  if(!NIL_P(hash))
+    rb_get_kwargs(hash, &id, 0, 1, &index);
+
+  if(index == Qundef || !RTEST(index)){
+    index = Qnil;
+  }else if(index == Qtrue){
+    if(!RB_TYPE_P(path, T_STRING))
+      rb_raise(rb_eArgError, "Index path is required for IO");
+    index = rb_str_plus(path, rb_str_new_cstr(".bidx"));
+  }else{
+    FilePathValue(index);
+  }
+
+  return file_apply(path, _view_file, &index);
+}
+
+/*
+ * Document-method: BEncode::Document#[]
+ * call-seq:
+ *    doc[index]
+ *    doc[key]
+ *
+ * Returns element of list by _index_ or dictionary value by _key_
+ * (String or Symbol). Returns nil if there's no such element.
+ * Nested lists and dictionaries are returned as BEncode::Document.
+ */
+
+static VALUE doc_aref(VALUE self, VALUE key){
+  bdocument* doc;
+  long i;
+
+  GET_DOC(self, doc);
+  DOC_TABLE(doc);
+
+  if(DOC_IS_DICT(doc)){
+    long* entry;
+
+    if(TYPE(key) == T_SYMBOL)
+      key = rb_sym2str(key);
+    if(!rb_obj_is_kind_of(key, rb_cString))
+      return Qnil;
+
+    i = doc_find_key(doc, RSTRING_PTR(key), RSTRING_LEN(key));
+    if(i == -1)
+      return Qnil;
+
+    entry = doc->table + i * 4;
+    return doc_value_at(doc, entry[2], entry[3]);
+  }
+
+  i = NUM2LONG(key);
+  if(i < 0)
+    i += doc->count;
+  if(i < 0 || i >= doc->count)
+    return Qnil;
+
+  return doc_value_at(doc, doc->table[i * 2], doc->table[i * 2 + 1]);
+}
+
+/*
+ * Document-method: BEncode::Document#dig
+ * call-seq:
+ *    doc.dig(key, ...)
+ *
+ * Extracts nested value like Hash#dig does touching
+ * only the containers on the way.
+ */
+
+static VALUE doc_dig(int argc, VALUE* argv, VALUE self){
+  rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+
+  self = doc_aref(self, *argv);
+  if(argc == 1 || NIL_P(self))
+    return self;
+
+  if(rb_typeddata_is_kind_of(self, &doc_type))
+    return doc_dig(argc - 1, argv + 1, self);
+  return rb_funcallv(self, digId, argc - 1, argv + 1);
+}
+
+static VALUE doc_enum_size(VALUE self, VALUE args, VALUE eobj){
+  return doc_size(self);
+}
+
+/*
+ * Document-method: BEncode::Document#each
+ * call-seq:
+ *    doc.each { |value| ... }
+ *    doc.each { |key, value| ... }
+ *
+ * Iterates over list elements or dictionary pairs.
+ * Repeated key is visited once at its first position with
+ * its last value, same as in BEncode.decode result.
+ */
+
+static VALUE doc_each(VALUE self){
+  bdocument* doc;
+  long i;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, doc_enum_size);
+  GET_DOC(self, doc);
+  DOC_TABLE(doc);
+
+  for(i = 0; i < DOC_SIZE(doc); ++i){
+    if(DOC_IS_DICT(doc)){
+      long* entry = doc->table + DOC_ENTRY(doc, i) * 4;
+      VALUE key = key_new(RSTRING_PTR(doc->src) + entry[0], entry[1]);
+      rb_yield(rb_assoc_new(key, doc_value_at(doc, entry[2], entry[3])));
+    }else{
+      rb_yield(doc_value_at(doc, doc->table[i * 2], doc->table[i * 2 + 1]));
+    }
+  }
+
+  return self;
+}
+
+/*
+ * Document-method: BEncode::Document#size
+ * call-seq:
+ *    doc.size
+ *
+ * Number of elements in list or distinct keys in dictionary.
+ */
+
+static VALUE doc_size(VALUE self){
+  bdocument* doc;
+
+  GET_DOC(self, doc);
+  DOC_TABLE(doc);
+  return LONG2NUM(DOC_SIZE(doc));
+}
+
+/*
+ * Document-method: BEncode::Document#keys
+ * call-seq:
+ *    doc.keys
+ *
+ * Returns dictionary keys without touching values.
+ */
+
+static VALUE doc_keys(VALUE self){
+  bdocument* doc;
+  VALUE ret;
+  long i;
+
+  GET_DOC(self, doc);
+  if(!DOC_IS_DICT(doc))
+    rb_raise(rb_eNoMethodError, "List has no keys");
+
+  DOC_TABLE(doc);
+  ret = rb_ary_new2(DOC_SIZE(doc));
+  for(i = 0; i < DOC_SIZE(doc); ++i){
+    long* entry = doc->table + DOC_ENTRY(doc, i) * 4;
+    rb_ary_push(ret, key_new(RSTRING_PTR(doc->src) + entry[0], entry[1]));
+  }
+
+  return ret;
+}
+
+/*
+ * Document-method: BEncode::Document#list?
+ * call-seq:
+ *    doc.list?
+ *
+ * True if document is a list.
+ */
+
+static VALUE doc_is_list(VALUE self){
+  bdocument* doc;
+
+  GET_DOC(self, doc);
+  return DOC_IS_DICT(doc) ? Qfalse : Qtrue;
+}
+
+/*
+ * Document-method: BEncode::Document#dict?
+ * call-seq:
+ *    doc.dict?
+ *
+ * True if document is a dictionary.
+ */
+
+static VALUE doc_is_dict(VALUE self){
+  bdocument* doc;
+
+  GET_DOC(self, doc);
+  return DOC_IS_DICT(doc) ? Qtrue : Qfalse;
+}
+
+/*
+ * Document-method: BEncode::Document#raw
+ * call-seq:
+ *    doc.raw
+ *
+ * Returns bencoded bytes of the document. String shares
+ * memory with the source.
+ */
+
+static VALUE doc_raw(VALUE self){
+  bdocument* doc;
+
+  GET_DOC(self, doc);
+  return rb_str_subseq(doc->src, doc->start, doc->end - doc->start);
+}
+
+/*
+ * Document-method: BEncode::Document#decode
+ * call-seq:
+ *    doc.decode
+ *
+ * Fully decodes the document into Ruby objects,
+ * same as BEncode.decode(doc.raw).
+ */
+
+static VALUE doc_decode(VALUE self){
+  return decode_string(doc_raw(self), NULL);
+}
+
+static void pieces_mark(void* ptr){
+  rb_gc_mark(((bpieces*)ptr)->src);
+}
+
+static size_t pieces_memsize(const void* ptr){
+  return sizeof(bpieces);
+}
+
+static const rb_data_type_t pieces_type = {
+  "BEncode::PieceList",
+  {pieces_mark, RUBY_TYPED_DEFAULT_FREE, pieces_memsize,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | TYPED_SHAREABLE
+};
+
+#define GET_PIECES(self, pieces) TypedData_Get_Struct(self, bpieces, &pieces_type, pieces)
+#define PIECES_PTR(pieces) (RSTRING_PTR((pieces)->src) + (pieces)->pos)
+
+/*
+ * Wraps _len_ bytes of digests at _pos_ of frozen _src_.
+ */
+
+static VALUE pieces_new(VALUE src, long pos, long len){
+  bpieces* pieces;
+  VALUE ret = TypedData_Make_Struct(PieceList, bpieces, &pieces_type, pieces);
+
+  pieces->src = src;
+  pieces->pos = pos;
+  pieces->count = len / PIECE_DIGEST;
+  return ret;
+}
+
+/*
+ * Document-method: BEncode::PieceList#[]
+ * call-seq:
+ *    pieces[index]
+ *
+ * Returns digest of piece _index_ as 20 byte String
+ * or nil if index is out of range. Negative index
+ * counts from the end.
+ */
+
+static VALUE pieces_aref(VALUE self, VALUE index){
+  bpieces* pieces;
+  long i = NUM2LONG(index);
+
+  GET_PIECES(self, pieces);
+  if(i < 0)
+    i += pieces->count;
+  if(i < 0 || i >= pieces->count)
+    return Qnil;
+
+  return rb_str_new(PIECES_PTR(pieces) + i * PIECE_DIGEST, PIECE_DIGEST);
+}
+
+static VALUE pieces_enum_size(VALUE self, VALUE args, VALUE eobj){
+  return pieces_size(self);
+}
+
+/*
+ * Document-method: BEncode::PieceList#each
+ * call-seq:
+ *    pieces.each { |digest| ... }
+ *
+ * Iterates over piece digests.
+ */
+
+static VALUE pieces_each(VALUE self){
+  bpieces* pieces;
+  long i;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, pieces_enum_size);
+  GET_PIECES(self, pieces);
+
+  for(i = 0; i < pieces->count; ++i)
+    rb_yield(rb_str_new(PIECES_PTR(pieces) + i * PIECE_DIGEST, PIECE_DIGEST));
+
+  return self;
+}
+
+/*
+ * Document-method: BEncode::PieceList#size
+ * call-seq:
+ *    pieces.size
+ *
+ * Number of pieces.
+ */
+
+static VALUE pieces_size(VALUE self){
+  bpieces* pieces;
+
+  GET_PIECES(self, pieces);
+  return LONG2NUM(pieces->count);
+}
+
+/*
+ * Document-method: BEncode::PieceList#match?
+ * call-seq:
+ *    pieces.match?(index, digest)
+ *
+ * True if _digest_ is the expected digest of piece _index_.
+ * Nothing is allocated, so it's cheap to call for
+ * every downloaded piece.
+ *
+ * Examples:
+ *
+ *   pieces.match?(i, Digest::SHA1.digest(data))
+ */
+
+static VALUE pieces_match(VALUE self, VALUE index, VALUE digest){
+  bpieces* pieces;
+  long i = NUM2LONG(index);
+
+  GET_PIECES(self, pieces);
+  StringValue(digest);
+  if(i < 0)
+    i += pieces->count;
+  if(i < 0 || i >= pieces->count || RSTRING_LEN(digest) != PIECE_DIGEST)
+    return Qfalse;
+
+  return memcmp(PIECES_PTR(pieces) + i * PIECE_DIGEST, RSTRING_PTR(digest), PIECE_DIGEST) ? Qfalse : Qtrue;
+}
+
+/*
+ * Document-method: BEncode::PieceList#to_s
+ * call-seq:
+ *    pieces.to_s
+ *
+ * Returns all digests concatenated, the way they're
+ * stored in torrent.
+ */
+
+static VALUE pieces_to_s(VALUE self){
+  bpieces* pieces;
+
+  GET_PIECES(self, pieces);
+  return rb_str_subseq(pieces->src, pieces->pos, pieces->count * PIECE_DIGEST);
+}
+
+/*
+ * Document-method: BEncode::PieceList#==
+ * call-seq:
+ *    pieces == other
+ *
+ * True if _other_ is PieceList or String with
+ * the same digests.
+ */
+
+static VALUE pieces_eq(VALUE self, VALUE other){
+  bpieces *pieces, *rhs;
+  const char* ptr;
+  long len;
+
+  GET_PIECES(self, pieces);
+  if(rb_typeddata_is_kind_of(other, &pieces_type)){
+    GET_PIECES(other, rhs);
+    ptr = PIECES_PTR(rhs);
+    len = rhs->count * PIECE_DIGEST;
+  }else if(RB_TYPE_P(other, T_STRING)){
+    ptr = RSTRING_PTR(other);
+    len = RSTRING_LEN(other);
+  }else{
+    return Qfalse;
+  }
+
+  return len == pieces->count * PIECE_DIGEST && !memcmp(PIECES_PTR(pieces), ptr, len) ? Qtrue : Qfalse;
+}
+
+static void parser_mark(void* ptr){
+  bparser* parser = ptr;
+  long i;
+
+  for(i = 0; i < parser->depth; ++i){
+    rb_gc_mark(parser->stack[i].container);
+    rb_gc_mark(parser->stack[i].key);
+  }
+  rb_gc_mark(parser->str);
+}
+
+static void parser_free(void* ptr){
+  bparser* parser = ptr;
+
+  if(parser->stack)
+    xfree(parser->stack);
+  xfree(parser);
+}
+
+static size_t parser_memsize(const void* ptr){
+  const bparser* parser = ptr;
+  return sizeof(*parser) + parser->capa * sizeof(parser_level);
+}
+
+static const rb_data_type_t parser_type = {
+  "BEncode::Parser",
+  {parser_mark, parser_free, parser_memsize,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+#define GET_PARSER(self, parser) TypedData_Get_Struct(self, bparser, &parser_type, parser)
+
+static void parser_clear(bparser* parser){
+  parser->depth = 0;
+  parser->offset = 0;
+  parser->state = PARSER_VALUE;
+  parser->str = Qnil;
+}
+
+static VALUE parser_alloc(VALUE klass){
+  bparser* parser;
+  VALUE ret = TypedData_Make_Struct(klass, bparser, &parser_type, parser);
+
+  parser->stack = NULL;
+  parser->capa = 0;
+  parser->busy = 0;
+  parser->max_depth = max_depth;
+  parser_clear(parser);
+  return ret;
+}
+
+/*
+ * Document-method: BEncode::Parser.new
+ * call-seq:
+ *    BEncode::Parser.new(max_depth: BEncode.max_depth)
+ *
+ * Creates parser limiting nesting of values to _max_depth_,
+ * nil disables the check.
+ */
+
+static VALUE parser_initialize(int argc, VALUE* argv, VALUE self){
+  VALUE hash, depth = Qundef;
+  bparser* parser;
+
+  rb_scan_args(argc, argv, ":", &hash);
+  GET_PARSER(self, parser);
+  if(!NIL_P(hash))
+    rb_get_kwargs(hash, &decode_opt_ids[DECODE_OPT_MAX_DEPTH], 0, 1, &depth);
+  if(depth != Qundef)
+    parser->max_depth = limit_value(depth, "Depth");
+  return self;
+}
+
+static void parser_fail(bparser* parser, int code, long pos, char ch){
+  scan_error err;
+
+  err.code = code;
+  err.pos = pos;
+  err.ch = ch;
+  parser_clear(parser);
+  raise_decode_error(&err);
+}
+
+/*
+ * Puts complete value into the current container.
+ * Returns true if it was a top level value.
+ */
+
+static int parser_add(bparser* parser, VALUE val){
+  parser_level* top;
+
+  if(!parser->depth)
+    return 1;
+
+  top = &parser->stack[parser->depth - 1];
+  if(BUILTIN_TYPE(top->container) == T_ARRAY){
+    rb_ary_push(top->container, val);
+  }else if(NIL_P(top->key)){
+    top->key = val;
+  }else{
+    rb_hash_aset(top->container, top->key, val);
+    top->key = Qnil;
+  }
+
+  return 0;
+}
+
+static int parser_is_key(bparser* parser){
+  parser_level* top = parser->depth ? &parser->stack[parser->depth - 1] : NULL;
+  return top && BUILTIN_TYPE(top->container) == T_HASH && NIL_P(top->key);
+}
+
+static void parser_push(bparser* parser, VALUE container){
+  if(parser->depth == parser->capa){
+    parser->capa = parser->capa ? parser->capa * 2 : 16;
+    REALLOC_N(parser->stack, parser_level, parser->capa);
+  }
+
+  parser->stack[parser->depth].container = container;
+  parser->stack[parser->depth].key = Qnil;
+  ++parser->depth;
+}
 
-  if(!*len)
-    return 0;
+static void parser_emit(VALUE val, VALUE ret){
+  if(NIL_P(ret))
+    rb_yield(val);
+  else
+    rb_ary_push(ret, val);
+}
 
-  if(**str == '-'){
-    t = -1;
-    ++*str;
-    --*len;
-  }
+static VALUE parser_feed_chunk(VALUE args){
+  VALUE self = rb_ary_entry(args, 0), chunk = rb_ary_entry(args, 1), ret = rb_ary_entry(args, 2);
+  const char* str = RSTRING_PTR(chunk);
+  long len = RSTRING_LEN(chunk), i = 0;
+  bparser* parser;
 
-  while(*len && **str >= '0' && **str <= '9'){
-    ret = ret * 10 + (**str - '0');
-    ++*str;
-    --*len;
+  GET_PARSER(self, parser);
+
+  while(i < len){
+    char c = str[i];
+    VALUE val;
+
+    switch(parser->state){
+      case PARSER_INT:
+        if(c >= '0' && c <= '9'){
+          if(!parser->sign)
+            parser->sign = 1;
+          /* num never gets more than LONG_DIGITS digits, longer ones go to str */
+          if(++parser->digits == LONG_DIGITS + 1)
+            parser->str = rb_sprintf("%s%ld", parser->sign == -1 ? "-" : "", parser->num);
+          if(parser->digits > LONG_DIGITS)
+            rb_str_buf_cat(parser->str, &c, 1);
+          else
+            parser->num = parser->num * 10 + (c - '0');
+          ++i;
+          continue;
+        }
+        if(c == '-' && !parser->sign){
+          parser->sign = -1;
+          ++i;
+          continue;
+        }
+        if(c != 'e')
+          parser_fail(parser, DECODE_E_INT, parser->offset + i, c);
+
+        ++i;
+        parser->state = PARSER_VALUE;
+        if(parser->digits > LONG_DIGITS){
+          val = rb_str_to_inum(parser->str, 10, Qfalse);
+          parser->str = Qnil;
+        }else{
+          val = LONG2NUM(parser->sign == -1 ? -parser->num : parser->num);
+        }
+        break;
+      case PARSER_LEN:
+        if(c >= '0' && c <= '9'){
+          if(parser->num > (LONG_MAX - (c - '0')) / 10)
+            parser_fail(parser, DECODE_E_STR_LEN, parser->offset + i, c);
+          parser->num = parser->num * 10 + (c - '0');
+          ++i;
+          continue;
+        }
+        if(c != ':')
+          parser_fail(parser, DECODE_E_STR_LEN, parser->offset + i, c);
+
+        ++i;
+        if(parser->num <= len - i){
+          val = parser_is_key(parser) ? key_new(str + i, parser->num) : rb_str_new(str + i, parser->num);
+          i += parser->num;
+          parser->state = PARSER_VALUE;
+          break;
+        }
+
+        parser->str = rb_str_buf_new(len - i);
+        parser->state = PARSER_STR;
+        continue;
+      case PARSER_STR:{
+        long take = parser->num < len - i ? parser->num : len - i;
+
+        rb_str_buf_cat(parser->str, str + i, take);
+        i += take;
+        parser->num -= take;
+        if(parser->num)
+          continue;
+
+        val = parser_is_key(parser) ? key_new(RSTRING_PTR(parser->str), RSTRING_LEN(parser->str)) : parser->str;
+        parser->str = Qnil;
+        parser->state = PARSER_VALUE;
+        break;
+      }
+      default:{
+        parser_level* top = parser->depth ? &parser->stack[parser->depth - 1] : NULL;
+
+        if(top && BUILTIN_TYPE(top->container) == T_HASH && NIL_P(top->key) && c != 'e' && (c < '0' || c > '9'))
+          parser_fail(parser, DECODE_E_KEY, parser->offset + i, c);
+
+        switch(c){
+          case 'l':
+          case 'd':
+            if(parser->max_depth != -1 && parser->depth >= parser->max_depth)
+              parser_fail(parser, DECODE_E_DEPTH, parser->offset + i, c);
+
+            val = c == 'l' ? rb_ary_new() : rb_hash_new();
+            parser_add(parser, val);
+            parser_push(parser, val);
+            ++i;
+            continue;
+          case 'i':
+            parser->state = PARSER_INT;
+            parser->num = parser->sign = parser->digits = 0;
+            ++i;
+            continue;
+          case '0'...'9':
+            parser->state = PARSER_LEN;
+            parser->num = c - '0';
+            ++i;
+            continue;
+          case 'e':
+            if(!top || (BUILTIN_TYPE(top->container) == T_HASH && !NIL_P(top->key)))
+              parser_fail(parser, DECODE_E_CONT_END, parser->offset + i, c);
+
+            val = top->container;
+            --parser->depth;
+            ++i;
+            if(parser->depth)
+              continue;
+            break;
+          default:
+            parser_fail(parser, DECODE_E_UNKNOWN, parser->offset + i, c);
+        }
+      }
+    }
+
+    if(parser_add(parser, val)){
+      parser->offset += i;
+      str += i;
+      len -= i;
+      i = 0;
+      parser_emit(val, ret);
+    }
   }
 
-  return ret * t;
+  parser->offset += i;
+  return Qnil;
 }
 
-#define NEXT_CHAR ++str; --len;
-#define ELEMENT_SCALAR 0
-#define ELEMENT_STRUCT 1
-#define ELEMENT_END 2
+static VALUE parser_unlock(VALUE self){
+  bparser* parser;
+
+  GET_PARSER(self, parser);
+  parser->busy = 0;
+  return Qnil;
+}
 
 /*
- * Document-method: BEncode.decode
+ * Document-method: BEncode::Parser#feed
  * call-seq:
- *     BEncode.decode(string)
+ *    parser.feed(chunk) { |value| ... }
+ *    parser.feed(chunk)
  *
- * Returns data structure from parsed _string_.
- * String must be valid bencoded data, or
- * BEncode::DecodeError will be raised with description
- * of error.
+ * Consumes next _chunk_ of bencoded stream. Chunks may be split
+ * at any byte. Every top level value completed by this chunk
+ * is yielded to the block, or returned as an array if no block
+ * given. BEncode::DecodeError is raised on malformed data with
+ * offset counted from the stream start, parser is reset after
+ * that.
  *
  * Examples:
  *
- *    BEncode.decode('i1e') => 1
- *    BEncode.decode('i-1e') => -1
- *    BEncode.decode('6:string') => 'string'
+ *   parser = BEncode::Parser.new
+ *   parser.feed('d3:key') => []
+ *   parser.feed('i1eei2e') => [{'key' => 1}, 2]
  */
 
-static VALUE decode(VALUE self, VALUE encoded){
-  long  len, rlen;
-  char* str;
-  VALUE ret, container_stack, current_container, key, crt;
+static VALUE parser_feed(VALUE self, VALUE chunk){
+  bparser* parser;
+  VALUE args, ret = rb_block_given_p() ? Qnil : rb_ary_new();
 
-  if(!rb_obj_is_kind_of(encoded, rb_cString))
-    rb_raise(rb_eTypeError, "String expected");
+  StringValue(chunk);
+  GET_PARSER(self, parser);
+  if(parser->busy)
+    rb_raise(rb_eRuntimeError, "Parser is already feeding");
 
-  len = rlen = RSTRING_LEN(encoded);
-  if(!len)
-    return Qnil;
+  parser->busy = 1;
+  args = rb_ary_new3(3, self, rb_str_new_frozen(chunk), ret);
+  rb_ensure(parser_feed_chunk, args, parser_unlock, self);
 
-  str = RSTRING_PTR(encoded);
-  container_stack = rb_ary_new();
-  current_container = ret = key = Qnil;
+  return NIL_P(ret) ? self : ret;
+}
 
-  while(len){
-    int state = ELEMENT_SCALAR;
-    switch(*str){
-      case 'l':
-      case 'd':
-        crt = *str == 'l' ? rb_ary_new() : rb_hash_new();
-        NEXT_CHAR;
-        if(NIL_P(current_container)){
-          if(max_depth == 0)
-            rb_raise(DecodeError, "Structure is too deep!");
-          ret = current_container = crt;
-          continue;
-        }
-        state = ELEMENT_STRUCT;
-        break;
-      case 'i':
-        NEXT_CHAR;
-        crt = LONG2FIX(parse_num(&str, &len));
+/*
+ * Document-method: BEncode::Parser#finish
+ * call-seq:
+ *    parser.finish
+ *
+ * Signals end of stream. Raises BEncode::DecodeError if
+ * the stream ended in the middle of a value.
+ */
 
-        if(!len)
-          rb_raise(DecodeError, "Unpexpected integer end!");
-        if(*str != 'e')
-          rb_raise(DecodeError, "Mailformed integer at %d byte: %c", rlen - len, *str);
+static VALUE parser_finish(VALUE self){
+  bparser* parser;
 
-        NEXT_CHAR;
-        break;
-      case '0'...'9':{
-        long slen = parse_num(&str, &len);
+  GET_PARSER(self, parser);
+  switch(parser->state){
+    case PARSER_INT:
+      parser_fail(parser, DECODE_E_INT_END, parser->offset, 0);
+    case PARSER_LEN:
+    case PARSER_STR:
+      parser_fail(parser, DECODE_E_STR_END, parser->offset, 0);
+  }
 
-        if(len && *str != ':')
-          rb_raise(DecodeError, "Invalid string length specification at %d: %c", rlen - len, *str);
-        if(!len || len < slen + 1)
-          rb_raise(DecodeError, "Unexpected string end!");
+  if(parser->depth)
+    parser_fail(parser, DECODE_E_EOF, parser->offset, BUILTIN_TYPE(parser->stack[parser->depth - 1].container) == T_HASH ? 'd' : 'l');
 
-        crt = rb_str_new(++str, slen);
-        str += slen;
-        len -= slen + 1;
-        break;
-      }
-      case 'e':
-        if(NIL_P(current_container))
-          rb_raise(DecodeError, "Unexpected container end at %d!", rlen - len);
-        current_container = rb_ary_pop(container_stack);
-        state = ELEMENT_END;
-        NEXT_CHAR;
-        break;
-      default:
-        rb_raise(DecodeError, "Unknown element type at %d: %c!", rlen - len, *str);
-    }
+  return self;
+}
 
-    if(NIL_P(current_container)){
-      if(NIL_P(ret))
-        ret = crt;
-      break;
-    }else if(state != ELEMENT_END){
-      if(BUILTIN_TYPE(current_container) == T_ARRAY){
-        rb_ary_push(current_container, crt);
-      }else if(NIL_P(key)){
-        if(BUILTIN_TYPE(crt) != T_STRING)
-          rb_raise(DecodeError, "Dictionary key must be a string (at %d)!", rlen - len);
-        key = crt;
-      }else{
-        rb_hash_aset(current_container, key, crt);
-        key = Qnil;
-      }
+/*
+ * Document-method: BEncode::Parser#offset
+ * call-seq:
+ *    parser.offset
+ *
+ * Number of bytes consumed since stream start.
+ */
 
-      if(state == ELEMENT_STRUCT){
-        rb_ary_push(container_stack, current_container);
-        if(max_depth != -1 && max_depth < RARRAY_LEN(container_stack) + 1)
-          rb_raise(DecodeError, "Structure is too deep!");
-        current_container = crt;
-      }
-    }
+static VALUE parser_offset(VALUE self){
+  bparser* parser;
+
+  GET_PARSER(self, parser);
+  return LONG2NUM(parser->offset);
+}
+
+/*
+ * Document-method: BEncode::Parser#reset
+ * call-seq:
+ *    parser.reset
+ *
+ * Drops partially parsed value and starts new stream.
+ */
+
+static VALUE parser_reset(VALUE self){
+  bparser* parser;
+
+  GET_PARSER(self, parser);
+  if(parser->busy)
+    rb_raise(rb_eRuntimeError, "Parser is already feeding");
+
+  parser_clear(parser);
+  return self;
+}
+
+static void decoder_mark(void* ptr){
+  const bdecoder* decoder = ptr;
+  long i;
+
+  for(i = 0; i < decoder->opts.path_count; ++i){
+    rb_gc_mark(decoder->opts.paths[i].key);
+    rb_gc_mark(decoder->opts.paths[i].klass);
+    rb_gc_mark(decoder->opts.paths[i].members);
   }
+}
 
-  if(len)
-    rb_raise(DecodeError, "String has garbage on the end (starts at %d).", rlen - len);
-  else if(!NIL_P(current_container))
-    rb_raise(DecodeError, "Unpexpected end of %s.", BUILTIN_TYPE(current_container) == T_HASH ? "dictionary" : "list");
+static void decoder_free(void* ptr){
+  bdecoder* decoder = ptr;
 
-  return ret;
+  tape_free(&decoder->tape);
+  xfree(decoder);
+}
+
+static size_t decoder_memsize(const void* ptr){
+  const bdecoder* decoder = ptr;
+  size_t size = sizeof(*decoder);
+
+  if(decoder->tape.ptr != decoder->tape.buf)
+    size += decoder->tape.capa * sizeof(btoken);
+  if(decoder->tape.levels != decoder->tape.levels_buf)
+    size += decoder->tape.levels_capa * sizeof(tape_level);
+  return size;
 }
 
-static VALUE _decode_file(VALUE fp){
-  return decode(BEncode, rb_funcall(fp, readId, 0));
+static const rb_data_type_t decoder_type = {
+  "BEncode::Decoder",
+  {decoder_mark, decoder_free, decoder_memsize,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+#define GET_DECODER(self, decoder) TypedData_Get_Struct(self, bdecoder, &decoder_type, decoder)
+
+static VALUE decoder_alloc(VALUE klass){
+  bdecoder* decoder;
+  VALUE ret = TypedData_Make_Struct(klass, bdecoder, &decoder_type, decoder);
+
+  decode_opts_parse(&decoder->opts, Qnil);
+  tape_init(&decoder->tape);
+  decoder->busy = 0;
+  return ret;
 }
 
 /*
- * Document-method: BEncode.decode_file
+ * Document-method: BEncode::Decoder.new
  * call-seq:
- *    BEncode.decode_file(file)
+ *    BEncode::Decoder.new(options = {})
  *
- * Loads content of _file_ and decodes it.
- * _file_ may be either IO instance or
- * String path to file.
+ * Creates decoder using _options_ of BEncode.decode for every
+ * call. Options are parsed once here, limits not given default
+ * to module settings at this moment.
  *
  * Examples:
  *
- *   BEncode.decode_file('/path/to/file.torrent')
- *
- *   open('/path/to/file.torrent', 'rb') do |f|
- *     BEncode.decode_file(f)
- *   end
+ *   decoder = BEncode::Decoder.new(symbolize_keys: true, max_depth: 8)
+ *   decoder.decode('d1:y1:qe') # => {:y=>"q"}
+ */
+
+static VALUE decoder_initialize(int argc, VALUE* argv, VALUE self){
+  VALUE hash;
+  bdecoder* decoder;
+
+  rb_scan_args(argc, argv, "0:", &hash);
+  GET_DECODER(self, decoder);
+  if(decoder->busy)
+    rb_raise(rb_eRuntimeError, "Decoder is already decoding");
+
+  decode_opts_parse(&decoder->opts, hash);
+  return self;
+}
+
+static VALUE decoder_run(VALUE ptr){
+  decoder_call* call = (decoder_call*)ptr;
+
+  return decode_tape(call->encoded, &call->decoder->opts, &call->decoder->tape, 1);
+}
+
+/*
+ * Empties tape for the next call. Tape that grew too big for
+ * some unusual input is released instead of being kept forever.
  */
 
-static VALUE decode_file(VALUE self, VALUE path){
-  if(rb_obj_is_kind_of(path, rb_cIO)){
-    return _decode_file(path);
+static VALUE decoder_done(VALUE ptr){
+  bdecoder* decoder = ((decoder_call*)ptr)->decoder;
+
+  if(decoder->tape.capa > DECODER_TAPE_KEEP){
+    tape_free(&decoder->tape);
   }else{
-    VALUE fp = rb_file_open_str(path, "rb");
-    return rb_ensure(_decode_file, fp, rb_io_close, fp);
+    decoder->tape.size = 0;
+    decoder->tape.depth = 0;
   }
+  decoder->busy = 0;
+  return Qnil;
+}
+
+/*
+ * Document-method: BEncode::Decoder#decode
+ * call-seq:
+ *    decoder.decode(string)
+ *
+ * Same as BEncode.decode(_string_, _options_) with options given
+ * to BEncode::Decoder.new. Token buffer is kept between calls, so
+ * only the result itself is allocated. If decoder is already in
+ * use by another thread, this call gets buffers of its own.
+ */
+
+static VALUE decoder_decode(VALUE self, VALUE encoded){
+  decoder_call call;
+  bdecoder* decoder;
+
+  GET_DECODER(self, decoder);
+  if(decoder->busy)
+    return decode_string(encoded, &decoder->opts);
+
+  call.decoder = decoder;
+  call.encoded = encoded;
+  decoder->busy = 1;
+  return rb_ensure(decoder_run, (VALUE)&call, decoder_done, (VALUE)&call);
 }
 
 /*
@@ -222,58 +3670,212 @@ static VALUE decode_file(VALUE self, VALUE path){
  *   'string'.bencode => '6:string'
  */
 
-static VALUE encode(VALUE self){
-  if(TYPE(self) == T_SYMBOL)
-    return encode(rb_id2str(SYM2ID(self)));
-
-  if(rb_obj_is_kind_of(self, rb_cString)){
-    long len = RSTRING_LEN(self);
-    return rb_sprintf("%ld:%.*s", len, len, RSTRING_PTR(self));
-  }
-  
-  if(rb_obj_is_kind_of(self, rb_cInteger))
-    return rb_sprintf("i%lde", NUM2LONG(self));
-  
-  if(rb_obj_is_kind_of(self, rb_cHash)){
-    VALUE ret = rb_str_new2("d");
-    rb_hash_foreach(self, hash_traverse, ret);
-    rb_str_cat2(ret, "e");
-    return ret;
+/*
+ * Appends _num_ followed by _end_ character to _buf_.
+ */
+
+static void encode_num(VALUE buf, long num, char end){
+  char tmp[24], *p = tmp + sizeof(tmp);
+  unsigned long n = num < 0 ? -(unsigned long)num : (unsigned long)num;
+
+  *--p = end;
+  do{
+    *--p = '0' + n % 10;
+  }while(n /= 10);
+  if(num < 0)
+    *--p = '-';
+
+  rb_str_buf_cat(buf, p, tmp + sizeof(tmp) - p);
+}
+
+static void encode_bytes(VALUE buf, const char* ptr, long len){
+  encode_num(buf, len, ':');
+  rb_str_buf_cat(buf, ptr, len);
+}
+
+/*
+ * Appends bencoded _obj_ to _buf_. Everything is written into the
+ * same buffer, containers don't build Strings for their children.
+ */
+
+static void encode_value(VALUE buf, VALUE obj){
+  if(SYMBOL_P(obj))
+    obj = rb_sym2str(obj);
+
+  if(rb_obj_is_kind_of(obj, rb_cString)){
+    encode_bytes(buf, RSTRING_PTR(obj), RSTRING_LEN(obj));
+    return;
   }
-  
-  if(rb_obj_is_kind_of(self, rb_cArray)){
-    long i, c;
-    VALUE *ptr, ret = rb_str_new2("l");
 
-    for(i = 0, c = RARRAY_LEN(self), ptr = RARRAY_PTR(self); i < c; ++i)
-      rb_str_concat(ret, encode(ptr[i]));
+  if(rb_obj_is_kind_of(obj, rb_cInteger)){
+    rb_str_buf_cat(buf, "i", 1);
+    if(FIXNUM_P(obj)){
+      encode_num(buf, FIX2LONG(obj), 'e');
+    }else{
+      rb_str_buf_append(buf, rb_big2str(obj, 10));
+      rb_str_buf_cat(buf, "e", 1);
+    }
+    return;
+  }
 
-    rb_str_cat2(ret, "e");
-    return ret;
+  if(rb_typeddata_is_kind_of(obj, &doc_type)){
+    rb_str_buf_append(buf, doc_raw(obj));
+    return;
+  }
+
+  if(rb_typeddata_is_kind_of(obj, &pieces_type)){
+    bpieces* pieces;
+
+    GET_PIECES(obj, pieces);
+    encode_bytes(buf, PIECES_PTR(pieces), pieces->count * PIECE_DIGEST);
+    return;
+  }
+
+  if(rb_obj_is_kind_of(obj, rb_cHash)){
+    rb_str_buf_cat(buf, "d", 1);
+    rb_hash_foreach(obj, hash_traverse, buf);
+    rb_str_buf_cat(buf, "e", 1);
+    return;
   }
 
-  rb_raise(EncodeError, "Don't know how to encode %s!", rb_class2name(CLASS_OF(self)));
+  if(rb_obj_is_kind_of(obj, rb_cArray)){
+    long i;
+
+    rb_str_buf_cat(buf, "l", 1);
+    for(i = 0; i < RARRAY_LEN(obj); ++i)
+      encode_value(buf, RARRAY_AREF(obj, i));
+    rb_str_buf_cat(buf, "e", 1);
+    return;
+  }
+
+  rb_raise(EncodeError, "Don't know how to encode %s!", rb_class2name(CLASS_OF(obj)));
+}
+
+static VALUE encode(VALUE self){
+  VALUE ret;
+
+  if(rb_typeddata_is_kind_of(self, &doc_type))
+    return doc_raw(self);
+
+  ret = rb_str_buf_new(0);
+  encode_value(ret, self);
+  return ret;
 }
 
-static int hash_traverse(VALUE key, VALUE val, VALUE str){
+static int hash_traverse(VALUE key, VALUE val, VALUE buf){
   if(!rb_obj_is_kind_of(key, rb_cString) && TYPE(key) != T_SYMBOL)
     rb_raise(EncodeError, "Keys must be strings or symbols, not %s!", rb_class2name(CLASS_OF(key)));
 
-  rb_str_concat(str, encode(key));
-  rb_str_concat(str, encode(val));
+  encode_value(buf, key);
+  encode_value(buf, val);
   return ST_CONTINUE;
 }
 
+static void encoder_mark(void* ptr){
+  rb_gc_mark(((bencoder*)ptr)->buf);
+}
+
+static size_t encoder_memsize(const void* ptr){
+  return sizeof(bencoder);
+}
+
+static const rb_data_type_t encoder_type = {
+  "BEncode::Encoder",
+  {encoder_mark, RUBY_TYPED_DEFAULT_FREE, encoder_memsize,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+#define GET_ENCODER(self, encoder) TypedData_Get_Struct(self, bencoder, &encoder_type, encoder)
+
+static VALUE encoder_alloc(VALUE klass){
+  bencoder* encoder;
+  VALUE ret = TypedData_Make_Struct(klass, bencoder, &encoder_type, encoder);
+
+  encoder->buf = rb_obj_hide(rb_str_buf_new(0));
+  encoder->keep = ENCODER_BUFFER_KEEP;
+  return ret;
+}
+
+/*
+ * Document-method: BEncode::Encoder.new
+ * call-seq:
+ *    BEncode::Encoder.new(buffer_size: 1048576)
+ *
+ * Creates encoder keeping scratch buffer of up to _buffer_size_
+ * bytes between calls. Output that doesn't fit gets a buffer
+ * of its own which is dropped afterwards.
+ */
+
+static VALUE encoder_initialize(int argc, VALUE* argv, VALUE self){
+  VALUE hash, size = Qundef;
+  bencoder* encoder;
+
+  rb_scan_args(argc, argv, "0:", &hash);
+  GET_ENCODER(self, encoder);
+  if(!NIL_P(hash))
+    rb_get_kwargs(hash, &bufferSizeId, 0, 1, &size);
+  if(size != Qundef && (encoder->keep = limit_value(size, "Buffer size")) == -1)
+    rb_raise(rb_eArgError, "Integer expected!");
+  return self;
+}
+
+/*
+ * Document-method: BEncode::Encoder#encode
+ * call-seq:
+ *    encoder.encode(object)       -> string
+ *    encoder.encode(object, out)  -> out
+ *
+ * Returns _object_ bencoded like BEncode.encode does. Output is
+ * built in encoder's scratch buffer and copied into a String of
+ * exact size. With _out_ String, like outbuf of IO#read, its
+ * content is replaced by the output and it becomes binary. Its
+ * capacity is reused, so nothing is allocated for the output.
+ *
+ * Examples:
+ *
+ *   encoder = BEncode::Encoder.new
+ *   encoder.encode('y' => 'r', 'r' => {'id' => id})
+ *   encoder.encode(reply, buf)
+ */
+
+static VALUE encoder_encode(int argc, VALUE* argv, VALUE self){
+  VALUE obj, out, ret;
+  bencoder* encoder;
+
+  rb_scan_args(argc, argv, "11", &obj, &out);
+  GET_ENCODER(self, encoder);
+  if(!NIL_P(out)){
+    StringValue(out);
+    rb_str_modify(out);
+    rb_str_set_len(out, 0);
+    rb_enc_associate(out, rb_ascii8bit_encoding());
+    encode_value(out, obj);
+    return out;
+  }
+
+  rb_str_set_len(encoder->buf, 0);
+  encode_value(encoder->buf, obj);
+  ret = rb_str_new(RSTRING_PTR(encoder->buf), RSTRING_LEN(encoder->buf));
+  if(rb_str_capacity(encoder->buf) > (size_t)encoder->keep)
+    encoder->buf = rb_obj_hide(rb_str_buf_new(0));
+  return ret;
+}
+
 /*
  * Document-method: String#bdecode
  * call-seq:
- *    string.bdecode
+ *    string.bdecode(options = {})
  *
- * Shortcut to BEncode.encode(_string_)
+ * Shortcut to BEncode.decode(_string_, _options_)
  */
 
-static VALUE str_bdecode(VALUE self){
-  return decode(BEncode, self);
+static VALUE str_bdecode(int argc, VALUE* argv, VALUE self){
+  VALUE hash;
+  decode_opts opts;
+
+  rb_scan_args(argc, argv, "0:", &hash);
+  decode_opts_parse(&opts, hash);
+  return decode_string(self, &opts);
 }
 
 /*
@@ -288,6 +3890,40 @@ static VALUE mod_encode(VALUE self, VALUE x){
   return encode(x);
 }
 
+/*
+ * Returns limit given by Integer _val_ or -1 for nil (no limit).
+ * _what_ names the limit in error message.
+ */
+
+static long limit_value(VALUE val, const char* what){
+  long t;
+
+  if(NIL_P(val))
+    return -1;
+
+  if(!rb_obj_is_kind_of(val, rb_cInteger))
+    rb_raise(rb_eArgError, "Integer expected!");
+
+  t = NUM2LONG(val);
+  if(t < 0)
+    rb_raise(rb_eArgError, "%s must be greater than or equal to 0", what);
+  return t;
+}
+
+/*
+ * Module level defaults are process wide, only main Ractor may
+ * change them. Other Ractors pass limits to each call instead.
+ */
+
+static void main_ractor_check(const char* name){
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  VALUE ractor = rb_const_get(rb_cObject, rb_intern("Ractor"));
+
+  if(rb_funcall(ractor, currentId, 0) != rb_funcall(ractor, mainId, 0))
+    rb_raise(rb_const_get(ractor, rb_intern("IsolationError")), "can not set BEncode.%s from non-main Ractor", name);
+#endif
+}
+
 /*
  * Document-method: max_depth
  * call-seq:
@@ -309,30 +3945,102 @@ static VALUE get_max_depth(VALUE self){
  * Expects integer greater or equal to 0.
  * By default this value is 5000.
  * Assigning nil will disable depth check.
+ * This is the default for every call, single call
+ * can override it with max_depth: option. Can be
+ * changed only from the main Ractor.
  */
 
 static VALUE set_max_depth(VALUE self, VALUE depth){
-  long t;
+  long t = limit_value(depth, "Depth");
 
-  if(NIL_P(depth)){
-    max_depth = -1;
-    return depth;
-  }
+  main_ractor_check("max_depth");
+  max_depth = t;
+  return depth;
+}
 
-  if(!rb_obj_is_kind_of(depth, rb_cInteger))
-    rb_raise(rb_eArgError, "Integer expected!");
+/*
+ * Document-method: nogvl_threshold
+ * call-seq:
+ *    BEncode.nogvl_threshold
+ *
+ * Get size of input starting from which decoding releases GVL.
+ */
 
-  t = NUM2LONG(depth);
-  if(t < 0)
-    rb_raise(rb_eArgError, "Depth must be greather than or equal to 0");
+static VALUE get_nogvl_threshold(VALUE self){
+  return nogvl_threshold == -1 ? Qnil : LONG2NUM(nogvl_threshold);
+}
 
-  max_depth = t;
-  return depth;
+/*
+ * Document-method: nogvl_threshold=
+ * call-seq:
+ *    BEncode.nogvl_threshold = _integer_
+ *
+ * Sets size in bytes starting from which BEncode.decode lets
+ * other threads run while it validates input. Ruby objects
+ * are still built with GVL held afterwards.
+ * Expects integer greater or equal to 0.
+ * By default this value is 1048576 (1MB).
+ * Assigning nil will keep GVL for inputs of any size.
+ * Single call can override it with nogvl_threshold: option.
+ * Can be changed only from the main Ractor.
+ */
+
+static VALUE set_nogvl_threshold(VALUE self, VALUE size){
+  long t = limit_value(size, "Threshold");
+
+  main_ractor_check("nogvl_threshold");
+  nogvl_threshold = t;
+  return size;
 }
 
 void Init_bencode_ext(){
+  int i;
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(true);
+#endif
+
   max_depth = 5000;
+  nogvl_threshold = NOGVL_THRESHOLD;
   readId = rb_intern("read");
+  binmodeId = rb_intern("binmode?");
+  filenoId = rb_intern("fileno");
+  posId = rb_intern("pos");
+  seekId = rb_intern("seek");
+  mappingId = rb_intern("mapping");
+  digId = rb_intern("dig");
+  decode_opt_ids[DECODE_OPT_PRESIZE] = rb_intern("presize");
+  decode_opt_ids[DECODE_OPT_STRICT] = rb_intern("strict");
+  decode_opt_ids[DECODE_OPT_SYMBOLIZE_KEYS] = rb_intern("symbolize_keys");
+  decode_opt_ids[DECODE_OPT_ONLY] = rb_intern("only");
+  decode_opt_ids[DECODE_OPT_EXCEPT] = rb_intern("except");
+  decode_opt_ids[DECODE_OPT_PIECE_LIST] = rb_intern("piece_list");
+  decode_opt_ids[DECODE_OPT_AS] = rb_intern("as");
+  decode_opt_ids[DECODE_OPT_SHARE] = rb_intern("share");
+  decode_opt_ids[DECODE_OPT_FREEZE] = rb_intern("freeze");
+  decode_opt_ids[DECODE_OPT_MAX_DEPTH] = rb_intern("max_depth");
+  decode_opt_ids[DECODE_OPT_NOGVL_THRESHOLD] = rb_intern("nogvl_threshold");
+  DataClass = rb_const_defined(rb_cObject, rb_intern("Data")) ? rb_const_get(rb_cObject, rb_intern("Data")) : Qnil;
+  for(i = 0; i < KNOWN_KEYS; ++i){
+    known_key_lens[i] = strlen(known_keys[i]);
+    known_key_syms[i] = ID2SYM(rb_intern(known_keys[i]));
+  }
+  threadsId = rb_intern("threads");
+  bufferSizeId = rb_intern("buffer_size");
+  currentId = rb_intern("current");
+  mainId = rb_intern("main");
+  scan_stat_keys[SCAN_STAT_VALID] = ID2SYM(rb_intern("valid"));
+  scan_stat_keys[SCAN_STAT_DICTS] = ID2SYM(rb_intern("dicts"));
+  scan_stat_keys[SCAN_STAT_LISTS] = ID2SYM(rb_intern("lists"));
+  scan_stat_keys[SCAN_STAT_KEYS] = ID2SYM(rb_intern("keys"));
+  scan_stat_keys[SCAN_STAT_STRINGS] = ID2SYM(rb_intern("strings"));
+  scan_stat_keys[SCAN_STAT_INTEGERS] = ID2SYM(rb_intern("integers"));
+  scan_stat_keys[SCAN_STAT_MAX_DEPTH] = ID2SYM(rb_intern("max_depth"));
+  scan_stat_keys[SCAN_STAT_STRING_BYTES] = ID2SYM(rb_intern("string_bytes"));
+  scan_stat_keys[SCAN_STAT_ERROR_OFFSET] = ID2SYM(rb_intern("error_offset"));
+  scan_stat_keys[SCAN_STAT_ERROR] = ID2SYM(rb_intern("error"));
+  sha1Id = rb_intern("sha1");
+  sha256Id = rb_intern("sha256");
   BEncode = rb_define_module("BEncode");
 
   /*
@@ -347,14 +4055,100 @@ void Init_bencode_ext(){
    */
   EncodeError = rb_define_class_under(BEncode, "EncodeError", rb_eRuntimeError);
 
-  rb_define_singleton_method(BEncode, "decode", decode, 1);
+  rb_define_singleton_method(BEncode, "decode", decode, -1);
+  rb_define_singleton_method(BEncode, "decode_prefix", decode_prefix, -1);
   rb_define_singleton_method(BEncode, "encode", mod_encode, 1);
-  rb_define_singleton_method(BEncode, "decode_file", decode_file, 1);
+  rb_define_singleton_method(BEncode, "decode_file", decode_file, -1);
+  rb_define_singleton_method(BEncode, "decode_many", decode_many, -1);
+  rb_define_singleton_method(BEncode, "each", each, -1);
+  rb_define_singleton_method(BEncode, "decode_all", decode_all, -1);
   rb_define_singleton_method(BEncode, "max_depth", get_max_depth, 0);
   rb_define_singleton_method(BEncode, "max_depth=", set_max_depth, 1);
+  rb_define_singleton_method(BEncode, "nogvl_threshold", get_nogvl_threshold, 0);
+  rb_define_singleton_method(BEncode, "nogvl_threshold=", set_nogvl_threshold, 1);
+
+  rb_define_singleton_method(BEncode, "view", view, 1);
+  rb_define_singleton_method(BEncode, "view_file", view_file, -1);
+  rb_define_singleton_method(BEncode, "build_index", build_index, -1);
+  rb_define_singleton_method(BEncode, "parse_events", parse_events, 2);
+  rb_define_singleton_method(BEncode, "valid?", is_valid, -1);
+  rb_define_singleton_method(BEncode, "scan", scan, -1);
+  rb_define_singleton_method(BEncode, "info_span", info_span, 1);
+  rb_define_singleton_method(BEncode, "info_hash", info_hash, -1);
+
+  /*
+   * Document-class: BEncode::Document
+   * Lazy read-only view of bencoded list or dictionary
+   * returned by BEncode.view.
+   */
+  Document = rb_define_class_under(BEncode, "Document", rb_cObject);
+  rb_undef_alloc_func(Document);
+  rb_include_module(Document, rb_mEnumerable);
+  rb_define_method(Document, "[]", doc_aref, 1);
+  rb_define_method(Document, "dig", doc_dig, -1);
+  rb_define_method(Document, "each", doc_each, 0);
+  rb_define_method(Document, "size", doc_size, 0);
+  rb_define_method(Document, "length", doc_size, 0);
+  rb_define_method(Document, "keys", doc_keys, 0);
+  rb_define_method(Document, "list?", doc_is_list, 0);
+  rb_define_method(Document, "dict?", doc_is_dict, 0);
+  rb_define_method(Document, "raw", doc_raw, 0);
+  rb_define_method(Document, "decode", doc_decode, 0);
+
+  /*
+   * Document-class: BEncode::PieceList
+   * Piece digests of torrent returned in place of _pieces_
+   * string by BEncode.decode with piece_list: true.
+   * Digests are read straight from decoded data.
+   */
+  PieceList = rb_define_class_under(BEncode, "PieceList", rb_cObject);
+  rb_undef_alloc_func(PieceList);
+  rb_include_module(PieceList, rb_mEnumerable);
+  rb_define_method(PieceList, "[]", pieces_aref, 1);
+  rb_define_method(PieceList, "each", pieces_each, 0);
+  rb_define_method(PieceList, "size", pieces_size, 0);
+  rb_define_method(PieceList, "length", pieces_size, 0);
+  rb_define_method(PieceList, "match?", pieces_match, 2);
+  rb_define_method(PieceList, "to_s", pieces_to_s, 0);
+  rb_define_method(PieceList, "==", pieces_eq, 1);
+
+  /*
+   * Document-class: BEncode::Parser
+   * Incremental decoder accepting bencoded stream in chunks.
+   * Depth limit is taken from BEncode.max_depth at creation time
+   * unless given to BEncode::Parser.new.
+   */
+  Parser = rb_define_class_under(BEncode, "Parser", rb_cObject);
+  rb_define_alloc_func(Parser, parser_alloc);
+  rb_define_method(Parser, "initialize", parser_initialize, -1);
+  rb_define_method(Parser, "feed", parser_feed, 1);
+  rb_define_method(Parser, "finish", parser_finish, 0);
+  rb_define_method(Parser, "offset", parser_offset, 0);
+  rb_define_method(Parser, "reset", parser_reset, 0);
+
+  /*
+   * Document-class: BEncode::Decoder
+   * Decoder with options fixed at creation. It keeps its token
+   * buffer between calls, which makes decoding lots of small
+   * messages cheaper than calling BEncode.decode with options.
+   */
+  Decoder = rb_define_class_under(BEncode, "Decoder", rb_cObject);
+  rb_define_alloc_func(Decoder, decoder_alloc);
+  rb_define_method(Decoder, "initialize", decoder_initialize, -1);
+  rb_define_method(Decoder, "decode", decoder_decode, 1);
+
+  /*
+   * Document-class: BEncode::Encoder
+   * Encoder building output in a scratch buffer kept between
+   * calls, or appending it to a String given by caller.
+   */
+  Encoder = rb_define_class_under(BEncode, "Encoder", rb_cObject);
+  rb_define_alloc_func(Encoder, encoder_alloc);
+  rb_define_method(Encoder, "initialize", encoder_initialize, -1);
+  rb_define_method(Encoder, "encode", encoder_encode, -1);
 
   rb_define_method(BEncode, "bencode", encode, 0);
-  rb_define_method(rb_cString, "bdecode", str_bdecode, 0);
+  rb_define_method(rb_cString, "bdecode", str_bdecode, -1);
 
   rb_include_module(rb_cObject, BEncode);
 }
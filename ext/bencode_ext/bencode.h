@@ -2,23 +2,581 @@
 #define __BENCODE_H__
 
 #include "ruby.h"
+#include "ruby/encoding.h"
+
+#if defined(HAVE_OPENSSL_SHA_H) && defined(HAVE_SHA256)
+#include <openssl/sha.h>
+#endif
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#endif
+
+#ifdef HAVE_RUBY_RACTOR_H
+#include "ruby/ractor.h"
+#define OBJ_SHAREABLE(obj) RB_FL_SET_RAW((obj), RUBY_FL_SHAREABLE)
+#define TYPED_SHAREABLE RUBY_TYPED_FROZEN_SHAREABLE
+#else
+#define OBJ_SHAREABLE(obj)
+#define TYPED_SHAREABLE 0
+#define rb_ractor_shareable_p(obj) 1
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <stdint.h>
+#define SWAR_DIGITS 1
+#endif
+
+#if LONG_MAX > 0x7fffffffL
+#define LONG_DIGITS 18
+#else
+#define LONG_DIGITS 9
+#endif
+
+#define SHORT_DIGITS 4
+#define SCAN_STACK_INLINE 64
+#define VALUE_STACK_INLINE 32
+#define TAPE_INLINE 64
+#define TAPE_SHIFT 3
+#define TAPE_POLL 0xFFFF
+#define NOGVL_THRESHOLD (1024 * 1024)
+#define BATCH_SIZE 256
+#define BATCH_THREADS 256
+#define PENDING_PAIRS 16
+#define PATH_NODES 64
+#define PIECE_DIGEST 20
+#define SHARE_THRESHOLD 1024
+#define INDEX_MAGIC "BEIDX02"
+#define INDEX_CHECK_PAGE 4096
+#define DECODER_TAPE_KEEP (64 * 1024)
+#define ENCODER_BUFFER_KEEP (1024 * 1024)
+
+#ifdef HAVE_RB_HASH_NEW_CAPA
+#define HASH_NEW_CAPA(capa) rb_hash_new_capa(capa)
+#else
+#define HASH_NEW_CAPA(capa) rb_hash_new()
+#endif
+#define MMAP_THRESHOLD (64 * 1024)
+#define STREAM_CHUNK (64 * 1024)
+
+enum {
+  DECODE_OK = 0,
+  DECODE_E_INT_END,
+  DECODE_E_INT,
+  DECODE_E_STR_LEN,
+  DECODE_E_STR_END,
+  DECODE_E_CONT_END,
+  DECODE_E_UNKNOWN,
+  DECODE_E_KEY,
+  DECODE_E_DEPTH,
+  DECODE_E_GARBAGE,
+  DECODE_E_EOF,
+  DECODE_E_NOMEM,
+  DECODE_E_INTERRUPT,
+  DECODE_E_CANON_INT,
+  DECODE_E_CANON_LEN,
+  DECODE_E_KEY_ORDER,
+  DECODE_E_KEY_DUP
+};
+
+typedef struct {
+  int code;
+  long pos;
+  char ch;
+} scan_error;
+
+typedef struct {
+  char *ptr;
+  long size, capa;
+  int strict;
+  long* keys;
+  char buf[SCAN_STACK_INLINE];
+  long keys_buf[SCAN_STACK_INLINE * 2];
+} scan_stack;
+
+enum {
+  EVENT_DICT = 0,
+  EVENT_LIST,
+  EVENT_KEY,
+  EVENT_STRING,
+  EVENT_INT,
+  EVENT_END,
+  EVENT_COUNT
+};
+
+typedef struct {
+  void (*fn)(void*, int, const char*, long);
+  void* ctx;
+} scan_events;
+
+enum {
+  TAPE_LIST = 0,
+  TAPE_DICT,
+  TAPE_KEY,
+  TAPE_STRING,
+  TAPE_INT,
+  TAPE_BIGNUM,
+  TAPE_END
+};
+
+typedef struct {
+  long pos;
+  long info;
+} btoken;
+
+typedef struct {
+  long open;
+  long count;
+} tape_level;
+
+typedef struct {
+  btoken* ptr;
+  long size, capa;
+  tape_level* levels;
+  long depth, levels_capa;
+  const volatile int* interrupt;
+  btoken buf[TAPE_INLINE];
+  tape_level levels_buf[SCAN_STACK_INLINE];
+} btape;
+
+/* Counters go in the same order as EVENT_* they count */
+enum {
+  SCAN_STAT_VALID = 0,
+  SCAN_STAT_DICTS,
+  SCAN_STAT_LISTS,
+  SCAN_STAT_KEYS,
+  SCAN_STAT_STRINGS,
+  SCAN_STAT_INTEGERS,
+  SCAN_STAT_MAX_DEPTH,
+  SCAN_STAT_STRING_BYTES,
+  SCAN_STAT_ERROR_OFFSET,
+  SCAN_STAT_ERROR,
+  SCAN_STAT_COUNT
+};
+
+typedef struct {
+  long counts[EVENT_COUNT];
+  long depth, max_depth;
+  long string_bytes;
+} scan_stats;
+
+typedef struct {
+  VALUE obj;
+  VALUE src;
+  ID ids[EVENT_COUNT];
+  scan_stack stack;
+} events_handler;
+
+typedef struct {
+  VALUE* ptr;
+  long size, capa;
+  volatile VALUE tmp;
+  VALUE buf[VALUE_STACK_INLINE];
+} value_stack;
+
+enum {
+  DECODE_OPT_PRESIZE = 0,
+  DECODE_OPT_STRICT,
+  DECODE_OPT_SYMBOLIZE_KEYS,
+  DECODE_OPT_ONLY,
+  DECODE_OPT_EXCEPT,
+  DECODE_OPT_PIECE_LIST,
+  DECODE_OPT_AS,
+  DECODE_OPT_SHARE,
+  DECODE_OPT_FREEZE,
+  DECODE_OPT_MAX_DEPTH,
+  DECODE_OPT_NOGVL_THRESHOLD,
+  DECODE_OPT_COUNT
+};
+
+typedef struct {
+  VALUE key;
+  long parent;
+  int leaf;
+  VALUE klass;
+  VALUE members;
+  int data;
+} path_node;
+
+typedef struct {
+  int presize;
+  int strict;
+  int symbolize_keys;
+  int piece_list;
+  int share;
+  int freeze;
+  long depth, nogvl;
+  long only, except, as;
+  long path_count;
+  path_node paths[PATH_NODES];
+} decode_opts;
+
+typedef struct {
+  VALUE buf[PENDING_PAIRS * 2];
+  long size;
+} pending_pairs;
+
+typedef struct {
+  VALUE src;
+  btape* tape;
+  const decode_opts* opts;
+  int share;
+} decode_ctx;
+
+typedef struct {
+  VALUE src;
+  VALUE io;
+  VALUE ret;
+  long pos;
+  long offset;
+  const decode_opts* opts;
+  int share;
+  scan_stack stack;
+  btape tape;
+} stream_ctx;
+
+typedef struct {
+  btape* tape;
+  btoken* tokens;
+  long count;
+  const char* str;
+  long len, depth, end;
+  int strict;
+  scan_error err;
+  volatile int interrupted;
+} tape_job;
+
+typedef struct {
+  VALUE list;
+  VALUE srcs;
+  VALUE pin;
+  VALUE ret;
+  tape_job* jobs;
+  btape* tapes;
+  long size, count, next;
+  int workers;
+  long chunk, depth;
+  decode_opts opts;
+  int threads;
+  volatile int interrupted;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+#endif
+} batch_ctx;
+
+typedef struct {
+  VALUE (*fn)(VALUE, const void*);
+  VALUE fp;
+  const void* data;
+} file_call;
+
+typedef struct {
+  void* ptr;
+  size_t len;
+} bmapping;
+
+typedef struct {
+  VALUE src;
+  long start, end;
+  long count;
+  long *table;
+  long *order, unique;
+  int sorted;
+  int checked;
+  VALUE owner;
+} bdocument;
+
+typedef struct {
+  char magic[8];
+  int64_t word;
+  int64_t size, mtime, mtime_nsec, base;
+  int64_t start, end, count, sorted;
+  uint64_t check;
+} bindex;
+
+typedef struct {
+  const bindex* stamp;
+  bindex idx;
+  int mapped;
+} index_read_ctx;
+
+typedef struct {
+  VALUE src;
+  long pos;
+  long count;
+} bpieces;
+
+enum {
+  PARSER_VALUE = 0,
+  PARSER_INT,
+  PARSER_LEN,
+  PARSER_STR
+};
+
+typedef struct {
+  VALUE container;
+  VALUE key;
+} parser_level;
+
+typedef struct {
+  parser_level* stack;
+  long depth, capa;
+  long max_depth;
+  long offset;
+  int state;
+  int sign;
+  long num;
+  long digits;
+  VALUE str;
+  int busy;
+} bparser;
+
+typedef struct {
+  decode_opts opts;
+  btape tape;
+  int busy;
+} bdecoder;
+
+typedef struct {
+  bdecoder* decoder;
+  VALUE encoded;
+} decoder_call;
+
+typedef struct {
+  VALUE buf;
+  long keep;
+} bencoder;
 
 static VALUE BEncode;
 static VALUE DecodeError;
 static VALUE EncodeError;
+static VALUE Document;
+static VALUE PieceList;
+static VALUE DataClass;
+static VALUE Parser;
+static VALUE Decoder;
+static VALUE Encoder;
 static VALUE readId;
+static ID binmodeId;
+static ID filenoId;
+static ID posId;
+static ID seekId;
+static ID mappingId;
+static ID digId;
+static ID sha1Id;
+static ID sha256Id;
 static long max_depth;
+static long nogvl_threshold;
+static ID decode_opt_ids[DECODE_OPT_COUNT];
+static ID threadsId;
+static ID bufferSizeId;
+static ID currentId;
+static ID mainId;
+static VALUE scan_stat_keys[SCAN_STAT_COUNT];
 
+/* Dictionary keys common in torrents, tracker responses and DHT messages */
+static const char* const known_keys[] = {
+  "a", "announce", "announce-list", "comment", "complete", "created by",
+  "creation date", "e", "encoding", "failure reason", "files", "id",
+  "incomplete", "info", "info_hash", "interval", "ip", "length", "md5sum",
+  "min interval", "name", "nodes", "path", "peers", "piece length",
+  "pieces", "port", "private", "q", "r", "t", "target", "token",
+  "url-list", "values", "y"
+};
+
+#define KNOWN_KEYS ((int)(sizeof(known_keys) / sizeof(*known_keys)))
+
+static long known_key_lens[KNOWN_KEYS];
+static VALUE known_key_syms[KNOWN_KEYS];
+
+#ifdef SWAR_DIGITS
+static inline int swar_digits(uint64_t);
+static inline long swar_value(uint64_t, int);
+#endif
 static long parse_num(char**, long*);
-static VALUE decode(VALUE, VALUE);
+static VALUE key_new(const char*, long);
+static VALUE key_sym(const char*, long);
+static VALUE int_value(const char*, long, long);
+static void scan_stack_init(scan_stack*, int);
+static int scan_stack_push(scan_stack*, char);
+static void scan_stack_free(scan_stack*);
+static long scan_fail(scan_error*, int, const char*, long, long);
+static int scan_key_check(scan_stack*, const char*, long, long);
+static void tape_init(btape*);
+static void* tape_grow(void*, void*, long, size_t);
+static int tape_add(btape*, int, long, long);
+static void tape_free(btape*);
+static long scan_run(scan_stack*, const char*, long, long, long, const scan_events*, btape*, scan_error*);
+static long scan_value(const char*, long, long, long, scan_error*);
+static VALUE decode_error_new(const scan_error*);
+NORETURN(static void raise_decode_error(const scan_error*));
+static void value_stack_init(value_stack*);
+static void value_stack_push(value_stack*, VALUE);
+static void value_stack_free(value_stack*);
+static long path_child(const decode_opts*, long, const char*, long);
+static long path_node_add(decode_opts*, long, VALUE);
+static long path_add(decode_opts*, long, VALUE);
+static void path_leaf(decode_opts*, long, VALUE);
+static long path_compile(decode_opts*, VALUE);
+static void path_class(decode_opts*, long, VALUE);
+static int path_class_i(VALUE, VALUE, VALUE);
+static long path_map(decode_opts*, VALUE);
+static long member_find(const path_node*, const char*, long);
+static int path_match(const decode_opts*, const char*, long, long*, long*);
+static void decode_opts_parse(decode_opts*, VALUE);
+static void pairs_flush(pending_pairs*, VALUE);
+static void pairs_add(pending_pairs*, VALUE, VALUE, VALUE);
+static long tape_build(btape*, const char*, long, long, int, scan_error*);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void* tape_build_nogvl(void*);
+static void tape_build_ubf(void*);
+#endif
+static long tape_build_unlocked(btape*, VALUE, long, int, scan_error*);
+static VALUE str_share(VALUE, long, long);
+static VALUE share_owner(VALUE, int);
+static VALUE value_freeze(VALUE);
+static VALUE tape_decode(VALUE);
+static VALUE decode_cleanup(VALUE);
+static VALUE decode_string(VALUE, const decode_opts*);
+static VALUE decode_tape(VALUE, const decode_opts*, btape*, int);
+static VALUE decode(int, VALUE*, VALUE);
+static VALUE decode_prefix(int, VALUE*, VALUE);
+static long batch_next(batch_ctx*);
+static int batch_job_build(batch_ctx*, tape_job*, btape*);
+static void* batch_worker(void*);
+static void* batch_run(void*);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void batch_ubf(void*);
+#endif
+static void batch_pin_mark(void*);
+static VALUE batch_decode(VALUE);
+static VALUE batch_cleanup(VALUE);
+static VALUE decode_many(int, VALUE*, VALUE);
+static void encode_num(VALUE, long, char);
+static void encode_bytes(VALUE, const char*, long);
+static void encode_value(VALUE, VALUE);
 static VALUE encode(VALUE);
 static int hash_traverse(VALUE, VALUE, VALUE);
-static VALUE str_bdecode(VALUE);
+static VALUE str_bdecode(int, VALUE*, VALUE);
 static VALUE mod_encode(VALUE, VALUE);
-static VALUE _decode_file(VALUE);
-static VALUE decode_file(VALUE, VALUE);
+#ifdef HAVE_MMAP
+static void mapping_free(void*);
+static size_t mapping_memsize(const void*);
+static VALUE file_map(VALUE);
+#endif
+static VALUE file_read(VALUE);
+static VALUE file_call_run(VALUE);
+static VALUE file_call_close(VALUE);
+static VALUE file_apply(VALUE, VALUE (*)(VALUE, const void*), const void*);
+static VALUE _decode_file(VALUE, const void*);
+static int stream_fill(stream_ctx*);
+static VALUE stream_run(VALUE);
+static VALUE stream_cleanup(VALUE);
+static VALUE stream_decode(VALUE, const decode_opts*, VALUE);
+static VALUE each(int, VALUE*, VALUE);
+static VALUE decode_all(int, VALUE*, VALUE);
+static void events_dispatch(void*, int, const char*, long);
+static VALUE events_run(VALUE);
+static VALUE events_cleanup(VALUE);
+static VALUE parse_events(VALUE, VALUE, VALUE);
+static long scan_string(VALUE, VALUE, const scan_events*, scan_error*);
+static VALUE is_valid(int, VALUE*, VALUE);
+static void stats_event(void*, int, const char*, long);
+static VALUE scan(int, VALUE*, VALUE);
+static VALUE decode_file(int, VALUE*, VALUE);
+static int info_span_find(const char*, long, long*, long*, scan_error*);
+static int info_span_get(VALUE, long*, long*);
+static VALUE info_span(VALUE, VALUE);
+static VALUE info_hash(int, VALUE*, VALUE);
+static void doc_mark(void*);
+static void doc_free(void*);
+static size_t doc_memsize(const void*);
+static VALUE doc_new(VALUE, long, long);
+static VALUE doc_value_at(bdocument*, long, long);
+static void doc_build_table(bdocument*);
+static void doc_dedup(bdocument*);
+static long doc_find_key(bdocument*, const char*, long);
+static VALUE view(VALUE, VALUE);
+static void index_stamp(VALUE, bindex*);
+static uint64_t index_check(const char*, long);
+static int index_valid(const char*, long, const bindex*, VALUE);
+static VALUE _build_index(VALUE, const void*);
+static VALUE build_index(int, VALUE*, VALUE);
+static VALUE _index_read(VALUE, const void*);
+static VALUE index_load(VALUE, VALUE);
+static VALUE _view_file(VALUE, const void*);
+static VALUE view_file(int, VALUE*, VALUE);
+static VALUE doc_aref(VALUE, VALUE);
+static VALUE doc_dig(int, VALUE*, VALUE);
+static VALUE doc_enum_size(VALUE, VALUE, VALUE);
+static VALUE doc_each(VALUE);
+static VALUE doc_size(VALUE);
+static VALUE doc_keys(VALUE);
+static VALUE doc_is_list(VALUE);
+static VALUE doc_is_dict(VALUE);
+static VALUE doc_raw(VALUE);
+static VALUE doc_decode(VALUE);
+static void pieces_mark(void*);
+static size_t pieces_memsize(const void*);
+static VALUE pieces_new(VALUE, long, long);
+static VALUE pieces_aref(VALUE, VALUE);
+static VALUE pieces_enum_size(VALUE, VALUE, VALUE);
+static VALUE pieces_each(VALUE);
+static VALUE pieces_size(VALUE);
+static VALUE pieces_match(VALUE, VALUE, VALUE);
+static VALUE pieces_to_s(VALUE);
+static VALUE pieces_eq(VALUE, VALUE);
+static void parser_mark(void*);
+static void parser_free(void*);
+static size_t parser_memsize(const void*);
+static void parser_clear(bparser*);
+NORETURN(static void parser_fail(bparser*, int, long, char));
+static VALUE parser_alloc(VALUE);
+static VALUE parser_initialize(int, VALUE*, VALUE);
+static int parser_add(bparser*, VALUE);
+static int parser_is_key(bparser*);
+static void parser_push(bparser*, VALUE);
+static void parser_emit(VALUE, VALUE);
+static VALUE parser_feed_chunk(VALUE);
+static VALUE parser_unlock(VALUE);
+static VALUE parser_feed(VALUE, VALUE);
+static VALUE parser_finish(VALUE);
+static VALUE parser_offset(VALUE);
+static VALUE parser_reset(VALUE);
+static long limit_value(VALUE, const char*);
+static void main_ractor_check(const char*);
+static void decoder_mark(void*);
+static void decoder_free(void*);
+static size_t decoder_memsize(const void*);
+static VALUE decoder_alloc(VALUE);
+static VALUE decoder_initialize(int, VALUE*, VALUE);
+static VALUE decoder_run(VALUE);
+static VALUE decoder_done(VALUE);
+static VALUE decoder_decode(VALUE, VALUE);
+static void encoder_mark(void*);
+static size_t encoder_memsize(const void*);
+static VALUE encoder_alloc(VALUE);
+static VALUE encoder_initialize(int, VALUE*, VALUE);
+static VALUE encoder_encode(int, VALUE*, VALUE);
 static VALUE get_max_depth(VALUE);
 static VALUE set_max_depth(VALUE, VALUE);
+static VALUE get_nogvl_threshold(VALUE);
+static VALUE set_nogvl_threshold(VALUE, VALUE);
 void Init_bencode_ext();
 
 #endif
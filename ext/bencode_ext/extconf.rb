@@ -3,4 +3,13 @@
 require 'mkmf'
 $CFLAGS='-g'
 $LDFLAGS='-g'
+have_header('openssl/sha.h') && have_library('crypto', 'SHA1', 'openssl/sha.h') && have_func('SHA256', 'openssl/sha.h')
+have_header('sys/mman.h') && have_func('mmap', 'sys/mman.h') && have_func('madvise', 'sys/mman.h')
+have_func('rb_enc_interned_str', 'ruby/encoding.h')
+have_func('rb_hash_new_capa', 'ruby.h')
+have_func('rb_hash_bulk_insert', 'ruby.h')
+have_header('ruby/ractor.h') && have_func('rb_ext_ractor_safe', 'ruby.h')
+have_header('ruby/thread.h') && have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_header('unistd.h')
+have_header('pthread.h') && have_library('pthread', 'pthread_create', 'pthread.h')
 create_makefile('bencode_ext')
@@ -1,11 +1,17 @@
 require 'helper'
 
 class TestBencodeExt < Test::Unit::TestCase
+  def teardown
+    BEncode.max_depth = 5000
+    BEncode.nogvl_threshold = 1024 * 1024
+  end
+
   def test_encoding
     assert_equal('i1e', 1.bencode)
     assert_equal('i-1e', -1.bencode)
     assert_equal('6:symbol', :symbol.bencode)
     assert_equal('6:string', 'string'.bencode)
+    assert_equal("3:a\0b", "a\0b".bencode)
     assert_equal('li1ei2ee', [1, 2].bencode)
     assert_equal('d3:keyi10ee', {:key => 10}.bencode)
     assert_equal('ld1:ki1eed1:ki2eed1:kd1:v3:123eee', [{:k => 1}, {:k => 2}, {:k => {:v => '123'}}].bencode)
@@ -45,4 +51,788 @@ class TestBencodeExt < Test::Unit::TestCase
 
     assert_nil(''.bdecode)
   end
+
+  def test_view
+    doc = BEncode.view('d4:infod5:filesld6:lengthi5e4:pathl1:aeee4:name3:abce1:xi1ee')
+    assert_kind_of(BEncode::Document, doc)
+    assert(doc.dict?)
+    assert_equal(2, doc.size)
+    assert_equal(%w[info x], doc.keys)
+    assert_equal(1, doc[:x])
+    assert_nil(doc['missing'])
+    assert_equal('abc', doc['info']['name'])
+    assert_equal(5, doc.dig('info', 'files', 0, 'length'))
+    assert_equal('a', doc.dig('info', 'files', -1, 'path', 0))
+    assert_equal([{'length' => 5, 'path' => ['a']}], doc['info']['files'].map(&:decode))
+    assert_equal('d6:lengthi5e4:pathl1:aee', doc.dig('info', 'files', 0).raw)
+    assert_equal('l1:ae', doc.dig('info', 'files', 0, 'path').bencode)
+    assert_equal(['x', 1], doc.to_a.last)
+
+    require 'objspace'
+    list, dict = BEncode.view("l#{'i1e' * 1000}e"), BEncode.view("d#{(1..1000).map { |i| "4:%04di1e" % i }.join}e")
+    word = [0].pack('l!').bytesize
+    list.size
+    dict.size
+    assert_operator(ObjectSpace.memsize_of(list), :<, 1000 * 2 * word + 200)
+    assert_operator(ObjectSpace.memsize_of(dict), :>=, 1000 * 4 * word)
+
+    dups = 'd1:bi1e1:ai2e1:bd1:ci3e1:ci4eee'
+    doc = BEncode.view(dups)
+    assert_equal({'b' => {'c' => 4}, 'a' => 2}, dups.bdecode)
+    assert_equal({'c' => 4}, doc['b'].decode)
+    assert_equal(4, doc.dig('b', 'c'))
+    assert_equal(2, doc.size)
+    assert_equal(%w[b a], doc.keys)
+    assert_equal(dups.bdecode.to_a, doc.map { |k, v| [k, v.is_a?(BEncode::Document) ? v.decode : v] })
+    assert_equal(1, doc['b'].size)
+    assert_equal([['c', 4]], doc['b'].to_a)
+
+    assert_equal(5, BEncode.view('i5e'))
+    assert_nil(BEncode.view(''))
+    assert_raises(BEncode::DecodeError) { BEncode.view('li1e') }
+    assert_raises(BEncode::DecodeError) { BEncode.view('li1eei2e') }
+    assert_raises(BEncode::DecodeError) { BEncode.view('di1ei2ee') }
+  end
+
+  def test_parser
+    data = 'd4:infod5:filesld6:lengthi-5eee4:name3:abce1:xi1eei42e5:helloli1ei2ee'
+    expected = [{'info' => {'files' => [{'length' => -5}], 'name' => 'abc'}, 'x' => 1}, 42, 'hello', [1, 2]]
+
+    parser = BEncode::Parser.new
+    values = []
+    data.each_char { |c| parser.feed(c) { |v| values << v } }
+    assert_equal(expected, values)
+    assert_equal(data.size, parser.offset)
+    assert_same(parser, parser.finish)
+
+    parser = BEncode::Parser.new
+    assert_equal([], parser.feed('d3:key'))
+    assert_equal([{'key' => 1}, 2], parser.feed('i1eei2e'))
+    assert_equal([], parser.feed('3:ab'))
+    assert_raises(BEncode::DecodeError) { parser.finish }
+
+    parser = BEncode::Parser.new
+    parser.feed('li1e')
+    error = assert_raises(BEncode::DecodeError) { parser.feed('i2ex') }
+    assert_match(/at 7/, error.message)
+    assert_equal(0, parser.offset)
+
+    BEncode.max_depth = 1
+    assert_raises(BEncode::DecodeError) { BEncode::Parser.new.feed('lli1eee') }
+
+  end
+
+  def test_parser_overflow
+    parser = BEncode::Parser.new
+    ['9223372036854775808:x', '99999999999999999999:x'].each do |str|
+      error = assert_raises(BEncode::DecodeError) { parser.feed(str) }
+      assert_match(/length/, error.message)
+      assert_equal([1], parser.feed('i1e'))
+    end
+    assert_raises(BEncode::DecodeError) { str = '9' * 30; str.each_char { |c| parser.feed(c) } }
+    assert_equal([1], parser.feed('i1e'))
+
+    ['9223372036854775807', '-9223372036854775808', '9' * 40, '-' + '9' * 40].each do |num|
+      values = []
+      "i#{num}e".each_char { |c| parser.feed(c) { |v| values << v } }
+      assert_equal([num.to_i], values)
+    end
+  end
+
+  class EventRecorder
+    attr_reader :events
+
+    def initialize
+      @events = []
+    end
+
+    %w[on_dict_start on_list_start on_end].each do |name|
+      define_method(name) { @events << name.to_sym }
+    end
+
+    %w[on_key on_string on_int].each do |name|
+      define_method(name) { |v| @events << [name.to_sym, v] }
+    end
+  end
+
+  def test_parse_events
+    handler = EventRecorder.new
+    assert_same(handler, BEncode.parse_events('d1:ali1e2:xye1:bi-2ee', handler))
+    assert_equal([:on_dict_start, [:on_key, 'a'], :on_list_start, [:on_int, 1], [:on_string, 'xy'], :on_end,
+                  [:on_key, 'b'], [:on_int, -2], :on_end], handler.events)
+
+    sum = Class.new { attr_reader :sum; def on_int(i); @sum = (@sum || 0) + i; end }.new
+    assert_equal(6, BEncode.parse_events('li1eli2ei3eee', sum).sum)
+
+    assert_raises(BEncode::DecodeError) { BEncode.parse_events('li1e', EventRecorder.new) }
+    assert_raises(BEncode::DecodeError) { BEncode.parse_events('i1ei2e', EventRecorder.new) }
+    assert_raises(RuntimeError) { BEncode.parse_events('li1ee', Class.new { def on_int(i); raise 'stop'; end }.new) }
+  end
+
+  def test_info_hash
+    require 'digest'
+    data = 'd8:announce3:url4:infod6:lengthi3e4:name1:xee'
+    info = data.bdecode['info'].bencode
+
+    assert_equal([22, 44], BEncode.info_span(data))
+    assert_equal(Digest::SHA1.digest(info), BEncode.info_hash(data))
+    assert_equal(Digest::SHA1.digest(info), BEncode.info_hash(data, :sha1))
+    assert_equal(Digest::SHA256.digest(info), BEncode.info_hash(data, :sha256))
+
+    noncanonical = 'd4:infod4:name1:x6:lengthi3eee'
+    assert_equal(Digest::SHA1.digest('d4:name1:x6:lengthi3ee'), BEncode.info_hash(noncanonical))
+
+    assert_nil(BEncode.info_hash('d1:ai1ee'))
+    assert_nil(BEncode.info_span('li1ee'))
+    assert_raises(ArgumentError) { BEncode.info_hash(data, :md5) }
+    assert_raises(BEncode::DecodeError) { BEncode.info_hash('d4:infoi1e') }
+    assert_raises(BEncode::DecodeError) { BEncode.info_hash('d4:infoi1eei1e') }
+  end
+
+  def test_decode_file
+    require 'tempfile'
+    data = {'info' => {'name' => 'abc', 'pieces' => 'x' * 100_000}, 'list' => (1..1000).to_a}
+    Tempfile.create('bencode') do |f|
+      f.binmode
+      f.write(data.bencode)
+      f.flush
+
+      assert_equal(data, BEncode.decode_file(f.path))
+      File.open(f.path, 'rb') do |io|
+        assert_equal(data, BEncode.decode_file(io))
+        assert(io.eof?)
+      end
+
+      doc = BEncode.view_file(f.path)
+      raw = doc['info'].raw
+      doc = nil
+      GC.start
+      assert_equal('abc', raw.bdecode['name'])
+      assert_equal(data['info'].bencode, raw)
+      assert_empty(raw.instance_variables)
+      assert_equal(raw, Marshal.load(Marshal.dump(raw)))
+
+      shared = BEncode.decode_file(f.path, share: true)
+      assert_operator(Marshal.dump(shared).bytesize, :<, data.bencode.bytesize + 2000)
+      assert_equal(data, Marshal.load(Marshal.dump(shared)))
+    end
+  end
+
+  def test_long_numbers
+    [12345, 123456789, -123456789012, 10**18 - 1, 10**18, 2**63 - 1, -2**63, 2**64 + 5, -10**30].each do |n|
+      assert_equal(n, n.bencode.bdecode)
+      assert_equal(n, BEncode.view("l#{n.bencode}i1ee")[0])
+      assert_equal([n], BEncode::Parser.new.feed(n.bencode))
+    end
+
+    assert_equal('abc', '0000000000000000000003:abc'.bdecode)
+    assert_raises(BEncode::DecodeError) { '123456789012345678901234567890:x'.bdecode }
+    assert_raises(BEncode::DecodeError) { '9223372036854775807:x'.bdecode }
+    assert(!BEncode.valid?('l9223372036854775807:xe'))
+  end
+
+  def test_interned_keys
+    data = 'ld6:lengthi1eed6:lengthi2eee'
+    first, second = data.bdecode
+    assert(first.keys.first.frozen?)
+    assert_same(first.keys.first, second.keys.first)
+    assert_same(first.keys.first, data.bdecode.last.keys.first)
+    assert_same(first.keys.first, BEncode.view(data)[0].keys.first)
+    assert_same(first.keys.first, BEncode::Parser.new.feed(data).first.first.keys.first)
+    assert_equal(1, first['length'])
+  end
+
+  def test_deep_nesting
+    BEncode.max_depth = nil
+    value = ('l' * 1000 + 'e' * 1000).bdecode
+    999.times { value = value.first }
+    assert_equal([], value)
+
+    BEncode.max_depth = 100
+    assert_nothing_raised { ('l' * 100 + 'e' * 100).bdecode }
+    assert_raises(BEncode::DecodeError) { ('l' * 101 + 'e' * 101).bdecode }
+    assert_raises(BEncode::DecodeError) { 'd3:keye'.bdecode }
+    assert_raises(BEncode::DecodeError) { 'd1:ad1:bee1:ci1ee'.bdecode }
+  end
+
+  def test_presize
+    data = {'a' => (1..100).to_a, 'b' => (1..40).map { |i| {"k#{i}" => i, 'x' => [i]} }, 'c' => {}, 'd' => []}
+    big = Hash[(1..50).map { |i| ["k#{i}", i] }]
+
+    assert_equal(data, data.bencode.bdecode(presize: true))
+    assert_equal(data, BEncode.decode(data.bencode, presize: true))
+    assert_equal(big, big.bencode.bdecode(presize: true))
+    assert_equal(big, big.bencode.bdecode)
+    assert_raises(BEncode::DecodeError) { 'li1e'.bdecode(presize: true) }
+    assert_raises(ArgumentError) { 'i1e'.bdecode(unknown: true) }
+  end
+
+  def test_two_stage
+    wide = (1..1000).map { |i| [i, -i, "s#{i}", {'k' => i}] }
+    assert_equal(wide, wide.bencode.bdecode)
+    assert_equal([[[[2**70, -2**70]]]], 'lllli1180591620717411303424ei-1180591620717411303424eeeee'.bdecode)
+    assert_equal({'a' => {'b' => {}}, 'c' => []}, 'd1:ad1:bdee1:clee'.bdecode)
+
+    BEncode.max_depth = nil
+    deep = 'l' * 300 + 'i1e' + 'e' * 300
+    assert_equal(1, deep.bdecode.flatten.first)
+
+    assert_raises(BEncode::DecodeError) { (wide.bencode + 'x').bdecode }
+    assert_raises(BEncode::DecodeError) { wide.bencode.chop.bdecode }
+    error = assert_raises(BEncode::DecodeError) { 'd1:ai1ei2ei3ee'.bdecode }
+    assert_match(/at 7/, error.message)
+  end
+
+  def test_nogvl
+    data = {'a' => (1..1000).to_a, 'b' => 'x' * 100, 'c' => [2**70]}
+
+    assert_equal(1024 * 1024, BEncode.nogvl_threshold)
+    BEncode.nogvl_threshold = 0
+    assert_equal(data, data.bencode.bdecode)
+    assert_raises(BEncode::DecodeError) { 'li1e'.bdecode }
+    threads = 4.times.map { Thread.new { 10.times.map { data.bencode.bdecode } } }
+    threads.each { |t| assert_equal([data] * 10, t.value) }
+
+    big = (1..300_000).to_a.bencode
+    t = Thread.new { loop { big.bdecode } }
+    sleep 0.05
+    t.kill.join
+    assert_equal(300_000, big.bdecode.size)
+
+    BEncode.nogvl_threshold = nil
+    assert_nil(BEncode.nogvl_threshold)
+    assert_equal(data, data.bencode.bdecode)
+    assert_raises(ArgumentError) { BEncode.nogvl_threshold = -1 }
+    assert_raises(ArgumentError) { BEncode.nogvl_threshold = '1' }
+  end
+
+  def test_decode_many
+    blobs = (1..3000).map { |i| {'id' => i, 'name' => "t#{i}", 'files' => [i, [i]]}.bencode }
+    expected = blobs.map(&:bdecode)
+
+    assert_equal(expected, BEncode.decode_many(blobs))
+    assert_equal(expected, BEncode.decode_many(blobs, threads: 4))
+    assert_equal(expected, BEncode.decode_many(blobs, threads: 1))
+    assert_equal([], BEncode.decode_many([]))
+
+    if GC.respond_to?(:compact)
+      compactor = Thread.new { 20.times { GC.compact } }
+      small = blobs.map(&:dup)
+      3.times { assert_equal(expected, BEncode.decode_many(small, threads: 4)) }
+      compactor.join
+    end
+
+    res = BEncode.decode_many(['i1e', 'li1e', '', 'x', 'de'], threads: 2)
+    assert_equal(1, res[0])
+    assert_kind_of(BEncode::DecodeError, res[1])
+    assert_equal('Unpexpected end of list.', res[1].message)
+    assert_nil(res[2])
+    assert_kind_of(BEncode::DecodeError, res[3])
+    assert_equal({}, res[4])
+
+    assert_raises(TypeError) { BEncode.decode_many(['i1e', 1]) }
+    assert_raises(TypeError) { BEncode.decode_many('i1e') }
+    assert_raises(ArgumentError) { BEncode.decode_many([], threads: 0) }
+    assert_raises(ArgumentError) { BEncode.decode_many([], unknown: 1) }
+  end
+
+  def test_validation
+    assert(BEncode.valid?('d1:ali1ei2eee'))
+    assert(BEncode.valid?('i1e'))
+    assert(!BEncode.valid?(''))
+    assert(!BEncode.valid?('li1e'))
+    assert(!BEncode.valid?('i1ei2e'))
+    assert(!BEncode.valid?('di1ei2ee'))
+    assert_raises(TypeError) { BEncode.valid?(1) }
+
+    BEncode.max_depth = 1
+    assert(BEncode.valid?('li1ee'))
+    assert(!BEncode.valid?('llee'))
+    BEncode.max_depth = 5000
+
+    stats = BEncode.scan('d1:ali1ei2e3:abcee')
+    assert_equal({:valid => true, :dicts => 1, :lists => 1, :keys => 1, :strings => 1, :integers => 2,
+                  :max_depth => 2, :string_bytes => 4, :error_offset => nil, :error => nil}, stats)
+
+    stats = BEncode.scan('li1ei2ex')
+    assert_equal(false, stats[:valid])
+    assert_equal(2, stats[:integers])
+    assert_equal(7, stats[:error_offset])
+    assert_match(/Unknown element type/, stats[:error])
+  end
+
+  def test_strict
+    canonical = {'a' => [0, -1, 10, 'x'], 'ab' => {'' => 2**70}, 'b' => ''}.bencode
+    assert_equal(canonical.bdecode, canonical.bdecode(strict: true))
+    assert(BEncode.valid?(canonical, strict: true))
+    assert_equal([{'b' => 1, 'a' => 2}], BEncode.decode_many(['d1:bi1e1:ai2ee']))
+
+    %w(i01e i-0e i-01e ie i-e i00e l02:abe d1:bi1e1:ai2ee d1:ai1e1:ai2ee d2:abi1e1:ai2ee).each do |s|
+      assert(BEncode.valid?(s), s)
+      assert(!BEncode.valid?(s, strict: true), s)
+      assert_raises(BEncode::DecodeError, s) { s.bdecode(strict: true) }
+    end
+
+    assert_match(/Duplicate/, BEncode.scan('d1:ai1e1:ai2ee', strict: true)[:error])
+    assert_match(/not sorted/, BEncode.scan('d1:bi1e1:ai2ee', strict: true)[:error])
+    assert_match(/integer at 1/, BEncode.scan('li01ee', strict: true)[:error])
+    assert_kind_of(BEncode::DecodeError, BEncode.decode_many(['i01e'], strict: true).first)
+
+    nested = 'd1:ad1:bi1e1:ci1ee1:bd1:ai1eee'
+    assert(BEncode.valid?(nested, strict: true))
+    deep = 'd1:a' + 'l' * 100 + 'e' * 100 + '1:bi1ee'
+    assert(BEncode.valid?(deep, strict: true))
+    deep = 'd1:a' * 100 + 'i1e' + '1:bi1ee' * 100
+    assert(BEncode.valid?(deep, strict: true))
+    assert(!BEncode.valid?(deep.sub('1:bi1ee', '1:bi1e1:bi1ee'), strict: true))
+  end
+
+  def test_symbolize_keys
+    data = {'announce' => 'http://t/', 'info' => {'files' => [{'length' => 1, 'path' => ['a']}],
+            'piece length' => 2, 'x-custom' => {}}}
+    expected = {:announce => 'http://t/', :info => {:files => [{:length => 1, :path => ['a']}],
+                :'piece length' => 2, :'x-custom' => {}}}
+
+    assert_equal(expected, data.bencode.bdecode(symbolize_keys: true))
+    assert_equal(expected, BEncode.decode(data.bencode, symbolize_keys: true))
+    assert_equal([expected], BEncode.decode_many([data.bencode], symbolize_keys: true))
+    assert_equal(data, data.bencode.bdecode(symbolize_keys: false))
+    assert_equal({"\xFF".b.to_sym => ['t']}, "d1:\xFFl1:tee".b.bdecode(symbolize_keys: true))
+
+    ping = {'t' => 'aa', 'y' => 'q', 'q' => 'ping', 'a' => {'id' => 'x' * 20}}.bencode
+    ping.bdecode(symbolize_keys: true)
+    before = GC.stat(:total_allocated_objects)
+    ping.bdecode
+    plain = GC.stat(:total_allocated_objects) - before
+    before = GC.stat(:total_allocated_objects)
+    ping.bdecode(symbolize_keys: true)
+    assert_operator(GC.stat(:total_allocated_objects) - before, :<=, plain + 1)
+  end
+
+  def test_each
+    require 'stringio'
+    require 'tempfile'
+
+    records = [1, 'abc', [], {'k' => ['v', 2 ** 70]}, {}]
+    stream = records.map(&:bencode).join
+
+    assert_equal(records, BEncode.decode_all(stream))
+    assert_equal([], BEncode.decode_all(''))
+    assert_equal(records, BEncode.each(stream).to_a)
+    assert_equal([{:k => ['v', 2 ** 70]}], BEncode.each('d1:kl1:vi1180591620717411303424eee', symbolize_keys: true).to_a)
+    yielded = []
+    assert_equal(stream, BEncode.each(stream) { |v| yielded << v })
+    assert_equal(records, yielded)
+    assert_equal(records, BEncode.decode_all(StringIO.new(stream)))
+
+    big = (1..5000).map { |i| {'seq' => i, 'data' => 'x' * (i % 300)} }
+    big << {'blob' => 'y' * 200_000}
+    assert_equal(big, BEncode.decode_all(StringIO.new(big.map(&:bencode).join)))
+    Tempfile.create('stream') do |f|
+      f.binmode
+      f.write(big.map(&:bencode).join)
+      f.rewind
+      assert_equal(big, BEncode.each(f).to_a)
+    end
+
+    assert_raises(BEncode::DecodeError) { BEncode.decode_all(StringIO.new(stream + 'li1e')) }
+    e = assert_raises(BEncode::DecodeError) { BEncode.decode_all(StringIO.new(big.map(&:bencode).join + 'li1ex')) }
+    assert_match(/ at #{big.map(&:bencode).join.bytesize + 4}:/, e.message)
+    assert_raises(BEncode::DecodeError) { BEncode.decode_all('i1ex') }
+    assert_raises(BEncode::DecodeError) { BEncode.decode_all('i1ei01e', strict: true) }
+    assert_raises(TypeError) { BEncode.decode_all(1) }
+
+    seen = []
+    BEncode.each(stream + 'x') { |v| seen << v; break if seen.size == 2 }
+    assert_equal(records[0, 2], seen)
+  end
+
+  def test_decode_prefix
+    piece = "\x00\xFFd1:ae".b * 100
+    msg = {'msg_type' => 1, 'piece' => 0, 'total_size' => 300}.bencode + piece
+
+    header, pos = BEncode.decode_prefix(msg)
+    assert_equal({'msg_type' => 1, 'piece' => 0, 'total_size' => 300}, header)
+    assert_equal(piece, msg.byteslice(pos..-1))
+    assert_equal([2, 6], BEncode.decode_prefix('i1ei2e', 3))
+    assert_equal([2, 6], BEncode.decode_prefix('i1ei2e', -3))
+    assert_equal([nil, 6], BEncode.decode_prefix('i1ei2e', 6))
+    assert_equal([{:a => 'b'}, 8], BEncode.decode_prefix('d1:a1:bexyz', symbolize_keys: true))
+    assert_equal([[1, 2], 8], BEncode.decode_prefix('li1ei2ee' + 'garbage'))
+
+    assert_raises(IndexError) { BEncode.decode_prefix('i1e', 4) }
+    assert_raises(IndexError) { BEncode.decode_prefix('i1e', -4) }
+    assert_raises(TypeError) { BEncode.decode_prefix(1) }
+    assert_raises(BEncode::DecodeError) { BEncode.decode_prefix('li1e') }
+    assert_raises(BEncode::DecodeError) { BEncode.decode_prefix('i01ex', strict: true) }
+    BEncode.max_depth = 1
+    assert_raises(BEncode::DecodeError) { BEncode.decode_prefix('llee') }
+  end
+
+  def test_only_except
+    files = [{'length' => 1, 'path' => ['a', 'b']}, {'length' => 2, 'path' => ['c']}]
+    data = {'announce' => 'http://t/', 'info' => {'name' => 'n', 'piece length' => 4, 'pieces' => 'p' * 40,
+            'files' => files}, 'list' => [1, [2], {'name' => 'x', 'pieces' => 'y'}]}
+    str = data.bencode
+
+    assert_equal({'announce' => 'http://t/', 'info' => {'name' => 'n', 'piece length' => 4,
+                  'files' => [{'length' => 1}, {'length' => 2}]}, 'list' => [1, [2], {'name' => 'x', 'pieces' => 'y'}]},
+                 BEncode.decode(str, except: ['info.pieces', 'info.files.path']))
+    assert_equal({'info' => {'name' => 'n', 'files' => [{'length' => 1}, {'length' => 2}]}},
+                 BEncode.decode(str, only: ['info.name', [:info, :files, :length]]))
+    assert_equal({'info' => {'piece length' => 4}}, BEncode.decode(str, only: [['info', 'piece length']]))
+    assert_equal({'list' => [1, [2], {'name' => 'x'}]}, BEncode.decode(str, only: 'list', except: 'list.pieces'))
+    assert_equal({'info' => data['info'].reject { |k, _| k == 'pieces' }},
+                 BEncode.decode(str, only: ['info', 'info.name'], except: 'info.pieces'))
+    assert_equal({}, BEncode.decode(str, only: []))
+    assert_equal(data, BEncode.decode(str, except: []))
+    assert_equal({:announce => 'http://t/'}, str.bdecode(only: :announce, symbolize_keys: true))
+    assert_equal([{'info' => {'name' => 'n'}}] * 2, BEncode.decode_many([str] * 2, only: 'info.name'))
+    assert_equal([1, [2]], BEncode.decode('li1eli2eee', only: 'x'))
+
+    assert_raises(BEncode::DecodeError) { BEncode.decode('d1:a1:b1:pi01ee', except: 'p', strict: true) }
+    assert_raises(BEncode::DecodeError) { BEncode.decode('d1:pli1ee', except: 'p') }
+    assert_raises(TypeError) { BEncode.decode(str, only: [1]) }
+    assert_raises(ArgumentError) { BEncode.decode(str, only: ['']) }
+    assert_raises(ArgumentError) { BEncode.decode(str, only: (1..100).map(&:to_s)) }
+  end
+
+  def test_piece_list
+    require 'digest'
+    chunks = (0...100).map { |i| "chunk#{i}" * 10 }
+    hashes = chunks.map { |c| Digest::SHA1.digest(c) }
+    data = {'info' => {'name' => 'x', 'pieces' => hashes.join}}
+    str = data.bencode
+
+    pieces = BEncode.decode(str, piece_list: true)['info']['pieces']
+    assert_instance_of(BEncode::PieceList, pieces)
+    assert_equal(100, pieces.size)
+    assert_equal(hashes[0], pieces[0])
+    assert_equal(hashes[-1], pieces[-1])
+    assert_nil(pieces[100])
+    assert_equal(hashes, pieces.to_a)
+    assert_equal(hashes, pieces.each.to_a)
+    assert_equal(100, pieces.each.size)
+    assert(pieces.match?(5, Digest::SHA1.digest(chunks[5])))
+    assert(!pieces.match?(5, Digest::SHA1.digest(chunks[6])))
+    assert(!pieces.match?(100, hashes[0]))
+    assert_equal(hashes.join, pieces.to_s)
+    assert(pieces == hashes.join)
+    assert(pieces == BEncode.decode(str, piece_list: true)['info']['pieces'])
+    assert(pieces != hashes[0])
+
+    assert_equal(str, BEncode.decode(str, piece_list: true).bencode)
+    copy = str.dup
+    decoded = copy.bdecode(piece_list: true)
+    copy.replace('x' * copy.size)
+    assert_equal(hashes, decoded['info']['pieces'].to_a)
+
+    assert_equal(data, BEncode.decode(str))
+    assert_equal({'pieces' => 'x' * 21}, BEncode.decode({'pieces' => 'x' * 21}.bencode, piece_list: true))
+    assert_equal(['x' * 20], BEncode.decode(['x' * 20].bencode, piece_list: true))
+    assert_instance_of(BEncode::PieceList, BEncode.decode_all(str * 2, piece_list: true)[1]['info']['pieces'])
+    assert_raises(TypeError) { BEncode::PieceList.new }
+  end
+
+  TorrentFile = Struct.new(:length, :path)
+  TorrentInfo = Struct.new(:name, :files, keyword_init: true)
+
+  def test_as
+    data = {'announce' => 'http://t/', 'info' => {'name' => 'n', 'pieces' => 'x' * 20,
+            'files' => [{'length' => 1, 'path' => ['a'], 'md5sum' => '0'}, {'path' => ['b', 'c']}]}}
+    str = data.bencode
+    files = [TorrentFile.new(1, ['a']), TorrentFile.new(nil, ['b', 'c'])]
+
+    assert_equal({'announce' => 'http://t/', 'info' => {'name' => 'n', 'pieces' => 'x' * 20, 'files' => files}},
+                 BEncode.decode(str, as: {'info.files' => TorrentFile}))
+    assert_equal({'announce' => 'http://t/', 'info' => TorrentInfo.new(name: 'n', files: files)},
+                 BEncode.decode(str, as: {:info => TorrentInfo, [:info, :files] => TorrentFile}))
+    assert_equal(TorrentFile.new(2, ['d']), BEncode.decode('d6:lengthi2e4:pathl1:dee', as: TorrentFile))
+    assert_equal(TorrentFile.new(2, nil), BEncode.decode('d6:lengthi2e4:pathl1:dee', as: TorrentFile, except: 'path'))
+    assert_equal([TorrentFile.new(1, nil)] * 2, BEncode.decode_many(['d6:lengthi1ee'] * 2, as: TorrentFile))
+    assert_equal([TorrentFile.new(1, nil)], BEncode.decode('ld6:lengthi1eee', as: {'' => TorrentFile}))
+    assert_equal(1, BEncode.decode('i1e', as: TorrentFile))
+
+    if defined?(Data) && Data.respond_to?(:define)
+      point = Data.define(:x, :y)
+      decoded = BEncode.decode('d1:xi1e1:yi2e1:zi3ee', as: point)
+      assert_equal(point.new(x: 1, y: 2), decoded)
+      assert(decoded.frozen?)
+    end
+
+    assert_raises(TypeError) { BEncode.decode(str, as: Hash) }
+    assert_raises(TypeError) { BEncode.decode(str, as: {'info' => 1}) }
+    assert_raises(TypeError) { BEncode.decode(str, as: Struct) }
+  end
+
+  def test_index
+    require 'tmpdir'
+    records = (0...20_000).map { |i| {'id' => i, 'peers' => 'p' * (i % 50)} }
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'scrape.benc')
+      File.binwrite(path, records.bencode)
+
+      assert_equal(path + '.bidx', BEncode.build_index(path))
+      doc = BEncode.view_file(path, index: true)
+      assert_equal(records.size, doc.size)
+      assert_equal(records[12_345], doc[12_345].decode)
+      assert_equal(records.last, doc[-1].decode)
+      assert_equal(49, doc.dig(19_999, 'peers').size)
+
+      dict = File.join(dir, 'dict.benc')
+      File.binwrite(dict, {'b' => 2, 'a' => [1], 'c' => 'x' * 70_000}.bencode)
+      File.open(dict, 'rb') { |f| BEncode.build_index(f, File.join(dir, 'dict.idx')) }
+      doc = BEncode.view_file(dict, index: File.join(dir, 'dict.idx'))
+      assert_equal(%w[b a c], doc.keys)
+      assert_equal([1], doc['a'].decode)
+      assert_equal(2, doc[:b])
+
+      # same size rewrite keeping mtime: elements are checked once accessed
+      mtime = File.mtime(path)
+      broken = File.binread(path)
+      broken[broken.index('i100e'), 5] = 'x100e'
+      File.binwrite(path, broken)
+      File.utime(mtime, mtime, path)
+      doc = BEncode.view_file(path, index: true)
+      assert_equal(records[99], doc[99].decode)
+      assert_raises(BEncode::DecodeError) { doc[100] }
+      assert_raises(BEncode::DecodeError) { BEncode.view_file(path) }
+
+      # stale index is rejected and the file is scanned instead
+      File.binwrite(path, broken.sub('i0e', 'i9e'))
+      File.utime(mtime, mtime, path)
+      assert_raises(BEncode::DecodeError) { BEncode.view_file(path, index: true) }
+      swapped = records.dup
+      swapped[200], swapped[201] = records[200].merge('peers' => 'p'), records[201].merge('peers' => '')
+      moved = swapped.bencode
+      moved[moved.index('i100e'), 5] = 'x100e'
+      assert_equal(broken.size, moved.size)
+      File.binwrite(path, moved)
+      File.utime(mtime, mtime, path)
+      assert_raises(BEncode::DecodeError) { BEncode.view_file(path, index: true) }
+
+      File.binwrite(path, swapped.bencode)
+      File.utime(mtime, mtime, path)
+      assert_equal(swapped[201], BEncode.view_file(path, index: true)[201].decode)
+      BEncode.build_index(path)
+      assert_equal(swapped[201], BEncode.view_file(path, index: true)[201].decode)
+
+      File.binwrite(path, broken)
+      assert_raises(BEncode::DecodeError) { BEncode.view_file(path, index: true) }
+      File.binwrite(path, records.bencode)
+      assert_equal(records[100], BEncode.view_file(path, index: true)[100].decode)
+      assert_equal(records[100], BEncode.view_file(path, index: File.join(dir, 'missing'))[100].decode)
+
+      # crafted index can't point outside of elements
+      BEncode.build_index(path)
+      index = File.binread(path + '.bidx')
+      head = index.size - records.size * 2 * 8
+      [[head + 8, 2**40], [head + 8, 5], [head, 0], [head - 24, 2**61], [head - 24, 1]].each do |at, value|
+        crafted = index.dup
+        crafted[at, 8] = [value].pack('q')
+        File.binwrite(path + '.bidx', crafted)
+        doc = BEncode.view_file(path, index: true)
+        assert_equal(records.size, doc.size)
+        assert_equal(records[0], doc[0].decode)
+      end
+
+      File.binwrite(path + '.bidx', 'junk')
+      assert_equal(records.size, BEncode.view_file(path, index: true).size)
+
+      File.binwrite(path, 'i1e')
+      assert_raises(ArgumentError) { BEncode.build_index(path) }
+      File.open(path, 'rb') { |f| assert_raises(ArgumentError) { BEncode.build_index(f) } }
+    end
+  end
+
+  def test_share
+    require 'objspace'
+    blob = 'b' * 100_000
+    data = {'blob' => blob, 'small' => 'abc', 'list' => ['c' * 2000]}
+    str = data.bencode
+
+    shared = str.bdecode(share: true)
+    assert_equal(data, shared)
+    assert_operator(ObjectSpace.memsize_of(shared['blob']), :<, 1000)
+    assert_operator(ObjectSpace.memsize_of(str.bdecode['blob']), :>=, blob.size)
+    assert_operator(ObjectSpace.memsize_of(str.dup.freeze.bdecode['blob']), :>=, blob.size)
+    assert_operator(ObjectSpace.memsize_of(str.dup.freeze.bdecode(share: false)['blob']), :>=, blob.size)
+    assert_operator(ObjectSpace.memsize_of(BEncode.decode_many([str.dup.freeze], share: true)[0]['blob']), :<, 1000)
+    assert_operator(ObjectSpace.memsize_of(BEncode.decode_all(str * 2, share: true)[1]['blob']), :<, 1000)
+
+    copy = str.dup
+    value = copy.bdecode(share: true)['blob']
+    copy.replace('x' * copy.size)
+    assert_equal(blob, value)
+    value << 'x'
+    value[0] = 'y'
+    assert_equal('y' + blob[1..-1] + 'x', value)
+    assert_equal(blob, str.bdecode(share: true)['blob'])
+    assert(!value.frozen?)
+
+    assert_equal([], shared['blob'].instance_variables)
+    assert_equal(shared['blob'], shared['blob'].dup)
+    dump = Marshal.dump(shared)
+    assert_operator(dump.bytesize, :<, blob.size + 2000 + 200)
+    assert_equal(data, Marshal.load(dump))
+    assert_equal([], Marshal.load(dump)['blob'].instance_variables)
+    assert_operator(Marshal.dump(shared['list']).bytesize, :<, 2100)
+
+    list = shared['list']
+    shared = nil
+    GC.start
+    assert_equal(['c' * 2000], list)
+  end
+
+  def test_freeze
+    pieces = 'p' * 40
+    data = {'announce' => 'http://tracker', 'big' => 'b' * 5000, 'n' => 2**70,
+            'info' => {'files' => [{'length' => 1, 'path' => ['a', 'b']}], 'pieces' => pieces}}
+    str = data.bencode
+    walk = lambda do |v|
+      assert(v.frozen?, v.inspect[0, 40])
+      case v
+      when Hash then v.each { |k, x| walk[k]; walk[x] }
+      when Array, Struct then v.each(&walk)
+      end
+    end
+
+    frozen = str.bdecode(freeze: true)
+    assert_equal(data, frozen)
+    walk[frozen]
+    assert(Ractor.shareable?(frozen))
+    assert_raise(FrozenError) { frozen['info']['files'] << 1 }
+    assert(!str.bdecode['info'].frozen?)
+    assert('i1e'.bdecode(freeze: true).frozen?)
+    assert('3:abc'.bdecode(freeze: true).frozen?)
+
+    walk[str.bdecode(freeze: true, symbolize_keys: true, share: true)]
+    BEncode.decode_all(str * 2, freeze: true).each(&walk)
+    BEncode.decode_many([str, str], freeze: true).each(&walk)
+    walk[BEncode.decode_prefix(str, freeze: true)[0]]
+
+    decoded = str.bdecode(freeze: true, piece_list: true, as: {'info.files' => TorrentFile})
+    walk[decoded]
+    assert_kind_of(TorrentFile, decoded['info']['files'][0])
+    assert_kind_of(BEncode::PieceList, decoded['info']['pieces'])
+    assert(Ractor.shareable?(decoded))
+
+    input = str.dup
+    input.instance_variable_set(:@note, [])
+    input.freeze
+    decoded = input.bdecode(freeze: true, share: true, piece_list: true)
+    assert(Ractor.shareable?(decoded))
+    assert_equal('b' * 5000, decoded['big'])
+    assert(!input.instance_variable_get(:@note).frozen?)
+  end
+
+  def test_per_call_limits
+    nested = 'lllleeee'
+    assert_raises(BEncode::DecodeError) { nested.bdecode(max_depth: 3) }
+    assert_equal([[[[]]]], nested.bdecode(max_depth: 4))
+    BEncode.max_depth = 1
+    assert_equal([[[[]]]], BEncode.decode(nested, max_depth: nil))
+    assert_equal([[[[]]]], BEncode.decode_all(nested, max_depth: 4)[0])
+    assert_equal([[[[]]]], BEncode.decode_many([nested], max_depth: 4)[0])
+    assert_equal([[[[]]]], BEncode.decode_prefix(nested, max_depth: 4)[0])
+    assert(BEncode.valid?(nested, max_depth: 4))
+    assert_raises(BEncode::DecodeError) { nested.bdecode }
+    assert_equal(1, BEncode.max_depth)
+    assert_equal([[[[]]]], BEncode::Parser.new(max_depth: 4).feed(nested)[0])
+    assert_raises(BEncode::DecodeError) { BEncode::Parser.new.feed(nested) }
+    assert_raises(BEncode::DecodeError) { BEncode::Parser.new(max_depth: 3).feed(nested) }
+    assert_raises(ArgumentError) { nested.bdecode(max_depth: -1) }
+    assert_raises(ArgumentError) { nested.bdecode(nogvl_threshold: '1') }
+    assert_raises(ArgumentError) { BEncode::Parser.new(depth: 1) }
+
+    big = ('x' * 2_000_000).bencode
+    assert_equal(2_000_000, big.bdecode(nogvl_threshold: 0, max_depth: nil).size)
+    assert_equal(2_000_000, big.bdecode(nogvl_threshold: nil).size)
+  end
+
+  def test_ractor
+    experimental = Warning[:experimental]
+    Warning[:experimental] = false
+    data = {'announce' => 'http://tracker', 'info' => {'files' => [{'length' => 1, 'path' => ['a']}]}}
+    str = data.bencode.freeze
+    ractors = 4.times.map do |i|
+      Ractor.new(str, i) do |s, n|
+        depth = begin
+          BEncode.decode('l' * n + 'e' * n, max_depth: 1)
+        rescue BEncode::DecodeError => e
+          e.class
+        end
+        [BEncode.decode(s, freeze: true), BEncode.decode_many([s] * 2, threads: 2), depth]
+      end
+    end
+    ractors.each_with_index do |r, i|
+      decoded, many, depth = r.take
+      assert_equal(data, decoded)
+      assert_equal([data, data], many)
+      assert_equal(i < 2 ? BEncode.decode('l' * i + 'e' * i) : BEncode::DecodeError, depth)
+    end
+    error = Ractor.new { begin; BEncode.max_depth = 1; rescue => e; e.class; end }.take
+    assert_equal(Ractor::IsolationError, error)
+    assert_equal(5000, BEncode.max_depth)
+  ensure
+    Warning[:experimental] = experimental
+  end
+
+  def test_decoder
+    decoder = BEncode::Decoder.new
+    msgs = [{'t' => 'aa', 'y' => 'q', 'q' => 'ping', 'a' => {'id' => 'x' * 20}}, [1, [2, [3]]], 'str', 42]
+    3.times { msgs.each { |m| assert_equal(m, decoder.decode(m.bencode)) } }
+    assert_nil(decoder.decode(''))
+    assert_raises(BEncode::DecodeError) { decoder.decode('li1e') }
+    assert_raises(TypeError) { decoder.decode(1) }
+    assert_equal([1], decoder.decode('li1ee'))
+
+    big = (0...100_000).to_a
+    assert_equal(big, decoder.decode(big.bencode))
+    assert_equal(big, decoder.decode(big.bencode))
+    assert_equal([1], decoder.decode('li1ee'))
+
+    decoder = BEncode::Decoder.new(symbolize_keys: true, max_depth: 2, only: 'a.id', freeze: true)
+    BEncode.max_depth = 1
+    decoded = decoder.decode(msgs[0].bencode)
+    GC.start
+    assert_equal({:a => {:id => 'x' * 20}}, decoded)
+    assert(decoded.frozen?)
+    assert_equal({:a => {:id => 'x' * 20}}, decoder.decode(msgs[0].bencode))
+    assert_raises(BEncode::DecodeError) { decoder.decode('llleee') }
+    assert_equal({:y => 'q'}, decoder.send(:initialize, symbolize_keys: true).decode('d1:y1:qe'))
+    assert_raises(ArgumentError) { BEncode::Decoder.new(foo: 1) }
+
+    BEncode.max_depth = 5000
+    as = BEncode::Decoder.new(as: {'info.files' => TorrentFile})
+    torrent = {'info' => {'files' => [{'length' => 1, 'path' => ['a']}]}}.bencode
+    GC.start
+    assert_equal(TorrentFile.new(1, ['a']), as.decode(torrent)['info']['files'][0])
+  end
+
+  def test_encoder
+    encoder = BEncode::Encoder.new
+    values = [1, -1, 0, 2**64, -2**70, 'str', :sym, '', [], {}, [1, ['a', {'b' => [:c]}]],
+              {'k' => 'v', :s => "\0\xff".b}, BEncode.view('d1:ai1ee'), 'é']
+    2.times { values.each { |v| assert_equal(v.bencode, encoder.encode(v)) } }
+    values.each { |v| assert_equal(Encoding::BINARY, encoder.encode(v).encoding) }
+    assert_raises(BEncode::EncodeError) { encoder.encode(1.0) }
+    assert_raises(BEncode::EncodeError) { encoder.encode({1 => 2}) }
+    assert_equal('i1e', encoder.encode(1))
+
+    out = 'é' * 100
+    assert_same(out, encoder.encode([1], out))
+    assert_equal('li1ee', out)
+    assert_equal(Encoding::BINARY, out.encoding)
+    encoder.encode('ab', out)
+    assert_equal('2:ab', out)
+    assert_raises(FrozenError) { encoder.encode(1, 'x'.freeze) }
+
+    small = BEncode::Encoder.new(buffer_size: 16)
+    big = 'x' * 100_000
+    assert_equal(big.bencode, small.encode(big))
+    assert_equal('i2e', small.encode(2))
+    assert_raises(ArgumentError) { BEncode::Encoder.new(buffer_size: -1) }
+    assert_raises(ArgumentError) { BEncode::Encoder.new(size: 1) }
+  end
 end